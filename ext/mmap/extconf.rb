@@ -12,6 +12,12 @@ dir_config('mmap')
 end
 
 have_func 'rb_fstring_new'
+have_func 'mremap', 'sys/mman.h'
+have_func 'fallocate', 'fcntl.h'
+have_func 'memfd_create', 'sys/mman.h'
+have_func 'sync_file_range', 'fcntl.h'
+have_func 'readahead', 'fcntl.h'
+have_func 'mlock2', 'sys/mman.h'
 has_semctl = have_func 'semctl', 'sys/sem.h'
 has_shmctl = have_func 'shmctl', 'sys/shm.h'
 
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #if HAVE_SEMCTL && HAVE_SHMCTL
 #include <sys/shm.h>
@@ -15,6 +16,7 @@
 #include <ruby/io.h>
 #include <ruby/re.h>
 #include <ruby/util.h>
+#include <ruby/thread.h>
 
 #ifndef StringValue
 #define StringValue(x)            \
@@ -72,26 +74,82 @@
 #endif
 #endif
 
-static VALUE mm_cMap;
+#ifdef MAP_NORESERVE
+#define MM_RESERVE (MAP_PRIVATE | MAP_ANON | MAP_NORESERVE)
+#else
+#define MM_RESERVE (MAP_PRIVATE | MAP_ANON)
+#endif
+
+static VALUE mm_cMap, mm_cPrefetch, mm_cSlice;
+static size_t mm_pagesize, mm_hugepagesize;
 
 #define EXP_INCR_SIZE 4096
 
+#define MM_PATH(t) ((t)->path == (char *)-1 ? "anonymous map" : (t)->path)
+
+#define MM_PAGE_FLOOR(x) ((x) & ~(mm_pagesize - 1))
+#define MM_PAGE_CEIL(x) MM_PAGE_FLOOR((x) + mm_pagesize - 1)
+#define MM_HUGE_CEIL(x) (((x) + mm_hugepagesize - 1) & ~(mm_hugepagesize - 1))
+
+#define MM_BASE(t) ((char *)(t)->addr - (t)->delta)
+#define MM_SPAN(t) ((t)->len + (t)->delta)
+
+typedef struct
+{
+    char *addr;
+    size_t beg, len;
+    unsigned long used;
+} mm_window;
+
+typedef struct
+{
+    size_t beg, end;
+} mm_range;
+
+#define MM_DIRTY_MAX 16
+
 typedef struct
 {
     MMAP_RETTYPE addr;
     int smode, pmode, vscope;
     int advice, flag;
     VALUE key;
-    int semid, shmid;
-    size_t len, real, incr;
+    int semid, shmid, fd;
+    size_t len, real, incr, gmax, maxlen, delta;
+    double growth;
     off_t offset;
     char *path, *template;
+    mm_window *win;
+    size_t wsize;
+    int wcount;
+    unsigned long wtick;
+    mm_range dirty[MM_DIRTY_MAX];
+    int ndirty;
+    size_t flushed;
+    size_t gap, gapsize;
+    int locktmp;
 } mm_mmap;
 
+/* background flusher, local to the process even for an IPC map */
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t mutex, io;
+    pthread_cond_t cond, done;
+    mm_mmap *t;
+    mm_range pending[MM_DIRTY_MAX];
+    int npending, busy, stop, started, error;
+    size_t target;
+    double interval;
+} mm_flusher;
+
 typedef struct
 {
     int count;
     mm_mmap *t;
+    mm_flusher *flusher;
+    VALUE view;
+    VALUE matches;
 } mm_ipc;
 
 typedef struct
@@ -105,20 +163,461 @@ typedef struct
 #define MM_ORIGIN 2
 #define MM_CHANGE (MM_MODIFY | 4)
 #define MM_PROTECT 8
+#define MM_KEEPGAP 16
 
 #define MM_FIXED (1 << 1)
 #define MM_ANON (1 << 2)
 #define MM_LOCK (1 << 3)
 #define MM_IPC (1 << 4)
 #define MM_TMP (1 << 5)
+#define MM_THP (1 << 6)
+#define MM_HUGETLB (1 << 7)
+#define MM_POPULATE (1 << 8)
+#define MM_WINDOW (1 << 9)
+#define MM_ONFAULT (1 << 10)
+#define MM_GAP (1 << 11)
+
+#define MM_GAP_MIN 65536
+
+#ifdef MAP_POPULATE
+#define MM_MAP_POPULATE(flag) (((flag) & MM_POPULATE) ? MAP_POPULATE : 0)
+#else
+#define MM_MAP_POPULATE(flag) 0
+#endif
 
 #if HAVE_SEMCTL && HAVE_SHMCTL
 static char template[1024];
 #endif
 
+static char *
+mm_i_window(mm_mmap *t, size_t off, size_t *avail)
+{
+    mm_window *w, *lru = t->win;
+    size_t beg = off - off % t->wsize;
+    int i;
+
+    for (i = 0; i < t->wcount; i++)
+    {
+        w = &t->win[i];
+        if (w->addr && w->beg == beg)
+        {
+            lru = w;
+            goto found;
+        }
+        if (!w->addr || (lru->addr && w->used < lru->used))
+        {
+            lru = w;
+        }
+    }
+    w = lru;
+    if (w->addr)
+    {
+        munmap(w->addr - t->delta, w->len + t->delta);
+        w->addr = NULL;
+    }
+    w->beg = beg;
+    w->len = t->real - beg;
+    if (w->len > 2 * t->wsize)
+    {
+        w->len = 2 * t->wsize;
+    }
+    w->addr = mmap(0, w->len + t->delta, PROT_READ, MAP_SHARED, t->fd,
+                   t->offset - t->delta + beg);
+    if (w->addr == MAP_FAILED)
+    {
+        w->addr = NULL;
+        rb_raise(rb_eArgError, "mmap failed (%d)", errno);
+    }
+    w->addr += t->delta;
+found:
+    lru->used = ++t->wtick;
+    *avail = lru->beg + lru->len - off;
+    return lru->addr + (off - lru->beg);
+}
+
+static void
+mm_i_window_read(mm_mmap *t, size_t off, size_t len, char *dst)
+{
+    size_t avail;
+    char *src;
+
+    while (len > 0)
+    {
+        src = mm_i_window(t, off, &avail);
+        if (avail > len)
+        {
+            avail = len;
+        }
+        memcpy(dst, src, avail);
+        dst += avail;
+        off += avail;
+        len -= avail;
+    }
+}
+
+/* add [beg, end) to the ranges, merging with the nearest one when full */
+static void
+mm_i_range_add(mm_range *ranges, int *count, size_t beg, size_t end)
+{
+    mm_range *r;
+    size_t gap, best_gap = (size_t)-1;
+    int i, best = 0;
+
+    for (i = 0; i < *count; i++)
+    {
+        r = &ranges[i];
+        if (beg <= r->end && r->beg <= end)
+        {
+            goto merge;
+        }
+        gap = beg > r->end ? beg - r->end : r->beg - end;
+        if (gap < best_gap)
+        {
+            best_gap = gap;
+            best = i;
+        }
+    }
+    if (*count < MM_DIRTY_MAX)
+    {
+        r = &ranges[(*count)++];
+        r->beg = beg;
+        r->end = end;
+        return;
+    }
+    r = &ranges[best];
+merge:
+    if (beg < r->beg)
+    {
+        r->beg = beg;
+    }
+    if (end > r->end)
+    {
+        r->end = end;
+    }
+}
+
+/*
+ * remember that [beg, end) of the map was written, the ranges are kept
+ * page aligned from the base of the mapping so that flush can hand
+ * them to msync() as they are
+ */
+static void
+mm_i_dirty(mm_mmap *t, size_t beg, size_t end)
+{
+    if (beg < end)
+    {
+        mm_i_range_add(t->dirty, &t->ndirty, MM_PAGE_FLOOR(beg + t->delta),
+                       MM_PAGE_CEIL(end + t->delta));
+    }
+}
+
+/*
+ * editing: :gap keeps the bytes after the last edit at gap + gapsize,
+ * put them back in place for the methods which need a contiguous map
+ */
+static void
+mm_i_gap_close(mm_mmap *t)
+{
+    memmove((char *)t->addr + t->gap, (char *)t->addr + t->gap + t->gapsize, t->real - t->gap);
+    mm_i_dirty(t, t->gap, t->real);
+    t->gapsize = 0;
+}
+
+/*
+ * write back [beg, end) from the base of the map. With an fd the range
+ * goes through sync_file_range() which does not need the address, the
+ * map can be moved meanwhile, mm_i_sync_done() must follow the batch.
+ * Otherwise f->io must be held.
+ */
+static int
+mm_i_sync_range(mm_flusher *f, size_t beg, size_t end)
+{
+    mm_mmap *t = f->t;
+    size_t span;
+    int ret;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (t->fd != -1)
+    {
+        return sync_file_range(t->fd, t->offset - t->delta + beg, end - beg,
+                               SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                   SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+    pthread_mutex_lock(&f->io);
+    span = MM_SPAN(t);
+    ret = 0;
+    if (beg < span)
+    {
+        ret = msync(MM_BASE(t) + beg, (end < span ? end : span) - beg, MS_SYNC);
+    }
+    pthread_mutex_unlock(&f->io);
+    return ret;
+}
+
+/*
+ * sync_file_range() neither writes the metadata nor flushes the cache of
+ * the device, fdatasync() does both once the ranges are written
+ */
+static int
+mm_i_sync_done(mm_flusher *f)
+{
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (f->t->fd != -1)
+    {
+        return fdatasync(f->t->fd);
+    }
+#endif
+    return 0;
+}
+
+static void
+mm_i_flusher_wait(mm_flusher *f)
+{
+    struct timespec ts;
+    double sec;
+
+    if (f->interval <= 0)
+    {
+        pthread_cond_wait(&f->cond, &f->mutex);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    sec = f->interval + ts.tv_nsec / 1e9;
+    ts.tv_sec += (time_t)sec;
+    ts.tv_nsec = (long)((sec - (time_t)sec) * 1e9);
+    pthread_cond_timedwait(&f->cond, &f->mutex, &ts);
+}
+
+static void *
+mm_i_flusher(void *arg)
+{
+    mm_flusher *f = (mm_flusher *)arg;
+    mm_range work[MM_DIRTY_MAX];
+    size_t target;
+    int i, n, err;
+
+    pthread_mutex_lock(&f->mutex);
+    for (;;)
+    {
+        if (!f->npending && !f->stop)
+        {
+            mm_i_flusher_wait(f);
+        }
+        if (f->npending)
+        {
+            n = f->npending;
+            memcpy(work, f->pending, n * sizeof(mm_range));
+            target = f->target;
+            f->npending = 0;
+        }
+        else if (f->stop)
+        {
+            break;
+        }
+        else if (f->interval > 0)
+        {
+            /* the map is expanded with f->io held */
+            pthread_mutex_lock(&f->io);
+            n = 1;
+            work[0].beg = 0;
+            work[0].end = f->t->len + f->t->delta;
+            target = f->t->real;
+            pthread_mutex_unlock(&f->io);
+        }
+        else
+        {
+            continue;
+        }
+        f->busy = 1;
+        pthread_mutex_unlock(&f->mutex);
+        for (err = 0, i = 0; i < n && !err; i++)
+        {
+            if (mm_i_sync_range(f, work[i].beg, work[i].end) == -1)
+            {
+                err = errno;
+            }
+        }
+        if (!err && mm_i_sync_done(f) == -1)
+        {
+            err = errno;
+        }
+        pthread_mutex_lock(&f->mutex);
+        f->busy = 0;
+        if (err)
+        {
+            f->error = err;
+        }
+        else
+        {
+            f->t->flushed = target;
+        }
+        pthread_cond_broadcast(&f->done);
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return NULL;
+}
+
+static mm_flusher *
+mm_i_flusher_new(mm_ipc *i_mm)
+{
+    mm_flusher *f = i_mm->flusher;
+
+    if (!f)
+    {
+        f = ALLOC(mm_flusher);
+        MEMZERO(f, mm_flusher, 1);
+        pthread_mutex_init(&f->mutex, NULL);
+        pthread_mutex_init(&f->io, NULL);
+        pthread_cond_init(&f->cond, NULL);
+        pthread_cond_init(&f->done, NULL);
+        i_mm->flusher = f;
+    }
+    return f;
+}
+
+static mm_flusher *
+mm_i_flusher_start(mm_ipc *i_mm)
+{
+    mm_flusher *f = mm_i_flusher_new(i_mm);
+    int err;
+
+    if (!f->started)
+    {
+        f->t = i_mm->t;
+        if ((err = pthread_create(&f->thread, NULL, mm_i_flusher, f)) != 0)
+        {
+            errno = err;
+            rb_sys_fail("pthread_create()");
+        }
+        f->started = 1;
+    }
+    return f;
+}
+
+static void *
+mm_i_flusher_idle(void *arg)
+{
+    mm_flusher *f = (mm_flusher *)arg;
+
+    pthread_mutex_lock(&f->mutex);
+    while (f->npending || f->busy)
+    {
+        pthread_cond_wait(&f->done, &f->mutex);
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return NULL;
+}
+
+static void *
+mm_i_flusher_join(void *arg)
+{
+    mm_flusher *f = (mm_flusher *)arg;
+
+    pthread_mutex_lock(&f->mutex);
+    f->stop = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+    pthread_join(f->thread, NULL);
+    return NULL;
+}
+
+/* stop the flusher once what was queued is written, return its error */
+static int
+mm_i_flusher_stop(mm_ipc *i_mm, int gvl)
+{
+    mm_flusher *f = i_mm->flusher;
+    int err;
+
+    if (!f)
+    {
+        return 0;
+    }
+    if (f->started)
+    {
+        if (gvl)
+        {
+            rb_thread_call_without_gvl(mm_i_flusher_join, f, NULL, NULL);
+        }
+        else
+        {
+            mm_i_flusher_join(f);
+        }
+    }
+    err = f->error;
+    pthread_mutex_destroy(&f->mutex);
+    pthread_mutex_destroy(&f->io);
+    pthread_cond_destroy(&f->cond);
+    pthread_cond_destroy(&f->done);
+    xfree(f);
+    i_mm->flusher = NULL;
+    return err;
+}
+
+static int
+mm_i_unmap(mm_mmap *t)
+{
+    int ret = 0;
+
+    if (t->flag & MM_WINDOW)
+    {
+        int i;
+
+        for (i = 0; i < t->wcount; i++)
+        {
+            if (t->win[i].addr)
+            {
+                munmap(t->win[i].addr - t->delta, t->win[i].len + t->delta);
+            }
+        }
+        xfree(t->win);
+        t->win = NULL;
+    }
+    else
+    {
+        if (t->gapsize)
+        {
+            mm_i_gap_close(t);
+        }
+        munmap(MM_BASE(t), t->maxlen ? t->maxlen : MM_SPAN(t));
+    }
+    if (t->path != (char *)-1)
+    {
+        if (t->real < t->len && t->vscope != MAP_PRIVATE)
+        {
+            if (t->fd != -1)
+                ret = ftruncate(t->fd, t->real);
+            else
+                ret = truncate(t->path, t->real);
+        }
+        free(t->path);
+    }
+    if (t->fd != -1)
+    {
+        close(t->fd);
+        t->fd = -1;
+    }
+    t->path = NULL;
+    return ret;
+}
+
+static void
+mm_mark(mm_ipc *i_mm)
+{
+    rb_gc_mark(i_mm->view);
+    rb_gc_mark(i_mm->matches);
+}
+
 static void
 mm_free(mm_ipc *i_mm)
 {
+    int ret = 0;
+
+    mm_i_flusher_stop(i_mm, 0);
+    if (i_mm->t->path)
+    {
+        ret = mm_i_unmap(i_mm->t);
+    }
 #if HAVE_SEMCTL && HAVE_SHMCTL
     if (i_mm->t->flag & MM_IPC)
     {
@@ -139,26 +638,15 @@ mm_free(mm_ipc *i_mm)
         shmdt(i_mm->t);
     }
     else
+#endif
     {
         free(i_mm->t);
     }
-#endif
-    if (i_mm->t->path)
+    free(i_mm);
+    if (ret == -1)
     {
-        munmap(i_mm->t->addr, i_mm->t->len);
-        if (i_mm->t->path != (char *)-1)
-        {
-            if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE &&
-                truncate(i_mm->t->path, i_mm->t->real) == -1)
-            {
-                free(i_mm->t->path);
-                free(i_mm);
-                rb_raise(rb_eTypeError, "truncate");
-            }
-            free(i_mm->t->path);
-        }
+        rb_raise(rb_eTypeError, "truncate");
     }
-    free(i_mm);
 }
 
 static void
@@ -223,15 +711,41 @@ mm_unlock(mm_ipc *i_mm)
 #endif
 }
 
-#define GetMmap(obj, i_mm, t_modify)            \
-    Data_Get_Struct(obj, mm_ipc, i_mm);         \
-    if (!i_mm->t->path)                         \
-    {                                           \
-        rb_raise(rb_eIOError, "unmapped file"); \
-    }                                           \
-    if ((t_modify & MM_MODIFY))                 \
-    {                                           \
-        rb_check_frozen(obj);                   \
+/* another thread works on the map without the GVL */
+#define MM_CHECK_LOCKTMP(i_mm)                                             \
+    if (i_mm->t->locktmp)                                                  \
+    {                                                                      \
+        rb_raise(rb_eRuntimeError, "can't modify map; temporarily locked"); \
+    }
+
+/* a windowed map is read through its windows only */
+#define MM_CHECK_READONLY(i_mm)                                           \
+    if (i_mm->t->flag & MM_WINDOW)                                        \
+    {                                                                     \
+        rb_raise(rb_eTypeError, "can't modify a read-only windowed map"); \
+    }
+
+#define GetMmap(obj, i_mm, t_modify)                      \
+    Data_Get_Struct(obj, mm_ipc, i_mm);                   \
+    if (!i_mm->t->path)                                   \
+    {                                                     \
+        rb_raise(rb_eIOError, "unmapped file");           \
+    }                                                     \
+    if (((t_modify) & MM_MODIFY))                         \
+    {                                                     \
+        rb_check_frozen(obj);                             \
+        MM_CHECK_READONLY(i_mm);                          \
+        MM_CHECK_LOCKTMP(i_mm);                           \
+    }                                                     \
+    if (i_mm->t->gapsize && !((t_modify) & MM_KEEPGAP))   \
+    {                                                     \
+        mm_i_gap_close(i_mm->t);                          \
+    }
+
+#define MM_CHECK_WINDOW(i_mm)                                                  \
+    if (i_mm->t->flag & MM_WINDOW)                                             \
+    {                                                                          \
+        rb_raise(rb_eTypeError, "operation not supported for a windowed map"); \
     }
 
 static VALUE
@@ -295,6 +809,75 @@ mm_ipc_key(VALUE obj)
     return INT2NUM(-1);
 }
 
+static int
+mm_i_inside(mm_ipc *i_mm, VALUE str)
+{
+    char *ptr;
+
+    if (!RB_TYPE_P(str, T_STRING))
+        return 0;
+    ptr = RSTRING_PTR(str);
+    return ptr >= (char *)i_mm->t->addr && ptr < (char *)i_mm->t->addr + i_mm->t->len;
+}
+
+/*
+ * $~ and the MatchData of the read-only methods reference the map. They
+ * are remembered, weakly, and get their own copy of the bytes only when
+ * the map is unmapped or moved
+ */
+static void
+mm_i_track_match(mm_ipc *i_mm, VALUE match)
+{
+    if (NIL_P(match) || !mm_i_inside(i_mm, RMATCH(match)->str))
+        return;
+    if (NIL_P(i_mm->matches))
+    {
+        i_mm->matches = rb_class_new_instance(0, 0, rb_path2class("ObjectSpace::WeakMap"));
+    }
+    rb_funcall(i_mm->matches, rb_intern("[]="), 2, match, Qtrue);
+}
+
+typedef struct
+{
+    mm_ipc *i_mm;
+    VALUE str, copy;
+} mm_detach;
+
+static VALUE
+mm_i_detach_key(RB_BLOCK_CALL_FUNC_ARGLIST(match, arg))
+{
+    mm_detach *st = (mm_detach *)arg;
+    VALUE str = RMATCH(match)->str;
+
+    if (!mm_i_inside(st->i_mm, str))
+        return Qnil;
+    /* the matches of a call share the same view, copy it once */
+    if (str != st->str)
+    {
+        st->str = str;
+        st->copy = rb_str_new(RSTRING_PTR(str), RSTRING_LEN(str));
+        rb_enc_copy(st->copy, str);
+        rb_obj_freeze(st->copy);
+    }
+    RB_OBJ_WRITE(match, &RMATCH(match)->str, st->copy);
+    return Qnil;
+}
+
+static void
+mm_i_detach_matches(mm_ipc *i_mm)
+{
+    VALUE matches = i_mm->matches;
+    mm_detach st;
+
+    if (NIL_P(matches))
+        return;
+    i_mm->matches = Qnil;
+    st.i_mm = i_mm;
+    st.str = st.copy = Qnil;
+    rb_block_call(matches, rb_intern("each_key"), 0, 0, mm_i_detach_key, (VALUE)&st);
+    RB_GC_GUARD(matches);
+}
+
 /*
  * Document-method: munmap
  * Document-method: unmap
@@ -309,21 +892,25 @@ mm_unmap(VALUE obj)
     mm_ipc *i_mm;
 
     GetMmap(obj, i_mm, 0);
+    MM_CHECK_LOCKTMP(i_mm);
     if (i_mm->t->path)
     {
+        int ret, err;
+
+        err = mm_i_flusher_stop(i_mm, 1);
+        mm_i_detach_matches(i_mm);
+        i_mm->view = Qnil;
         mm_lock(i_mm, Qtrue);
-        munmap(i_mm->t->addr, i_mm->t->len);
-        if (i_mm->t->path != (char *)-1)
+        ret = mm_i_unmap(i_mm->t);
+        mm_unlock(i_mm);
+        if (ret == -1)
         {
-            if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE &&
-                truncate(i_mm->t->path, i_mm->t->real) == -1)
-            {
-                rb_raise(rb_eTypeError, "truncate");
-            }
-            free(i_mm->t->path);
+            rb_raise(rb_eTypeError, "truncate");
+        }
+        if (err)
+        {
+            rb_raise(rb_eArgError, "msync(%d)", err);
         }
-        i_mm->t->path = NULL;
-        mm_unlock(i_mm);
     }
     return Qnil;
 }
@@ -335,10 +922,26 @@ mm_str(VALUE obj, int modify)
     VALUE ret = Qnil;
 
     GetMmap(obj, i_mm, modify & ~MM_ORIGIN);
+    MM_CHECK_WINDOW(i_mm);
     if (modify & MM_MODIFY)
     {
         rb_check_frozen(obj);
     }
+    if ((modify & (MM_MODIFY | MM_ORIGIN)) == MM_ORIGIN)
+    {
+        /* read only access, reuse the frozen view while the map stays put */
+        if (!RTEST(i_mm->view) ||
+            RSTRING_PTR(i_mm->view) != (char *)i_mm->t->addr ||
+            RSTRING_LEN(i_mm->view) != (long)i_mm->t->real)
+        {
+            i_mm->view = rb_obj_freeze(rb_str_new_static(i_mm->t->addr, i_mm->t->real));
+        }
+        else
+        {
+            ENC_CODERANGE_CLEAR(i_mm->view);
+        }
+        return i_mm->view;
+    }
     ret = rb_obj_alloc(rb_cString);
     RSTRING(ret)->as.heap.ptr = i_mm->t->addr;
     RSTRING(ret)->as.heap.aux.capa = i_mm->t->len;
@@ -364,7 +967,11 @@ mm_str(VALUE obj, int modify)
 /*
  * call-seq: to_str
  *
- * Convert object to a string
+ * Convert object to a string. The String is frozen and reads the
+ * mapped bytes, the same object is returned until the map is moved
+ * or its size changes. It is only valid while the map is mapped and
+ * unchanged, the strings derived from it can share its bytes: use
+ * #to_s or the methods of Mmap to get strings which outlive the map
  */
 static VALUE
 mm_to_str(VALUE obj)
@@ -372,58 +979,247 @@ mm_to_str(VALUE obj)
     return mm_str(obj, MM_ORIGIN);
 }
 
+/*
+ * the String methods called on the view return substrings which can
+ * share its buffer, copy them before they are given back
+ */
+static VALUE
+mm_i_detach(mm_ipc *i_mm, VALUE res)
+{
+    VALUE str;
+    long i;
+
+    switch (TYPE(res))
+    {
+    case T_STRING:
+        if (!mm_i_inside(i_mm, res))
+            break;
+        str = rb_str_new(RSTRING_PTR(res), RSTRING_LEN(res));
+        rb_enc_copy(str, res);
+        return str;
+
+    case T_ARRAY:
+        for (i = 0; i < RARRAY_LEN(res); i++)
+        {
+            rb_ary_store(res, i, mm_i_detach(i_mm, RARRAY_AREF(res, i)));
+        }
+        break;
+
+    case T_MATCH:
+        mm_i_track_match(i_mm, res);
+        break;
+    }
+    return res;
+}
+
+static VALUE
+mm_i_yield_detach(RB_BLOCK_CALL_FUNC_ARGLIST(val, obj))
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    mm_i_track_match(i_mm, rb_backref_get());
+    return rb_yield(mm_i_detach(i_mm, val));
+}
+
 typedef struct
 {
     mm_ipc *i_mm;
     size_t len;
 } mm_st;
 
-static VALUE
-mm_i_expand(VALUE arg)
+static void
+mm_i_touch(char *addr, size_t len)
 {
-    mm_st *st_mm = (mm_st *)arg;
-    int fd;
-    mm_ipc *i_mm = st_mm->i_mm;
-    size_t len = st_mm->len;
+    volatile char c;
+    size_t i;
 
-    if (munmap(i_mm->t->addr, i_mm->t->len))
+#ifdef MADV_POPULATE_READ
+    if (madvise(addr, len, MADV_POPULATE_READ) == 0)
     {
-        rb_raise(rb_eArgError, "munmap failed");
+        return;
     }
-    if ((fd = open(i_mm->t->path, i_mm->t->smode)) == -1)
+#endif
+    for (i = 0; i < len; i += mm_pagesize)
     {
-        rb_raise(rb_eArgError, "Can't open %s", i_mm->t->path);
+        c = addr[i];
     }
-    if (len > i_mm->t->len)
+    (void)c;
+}
+
+static int
+mm_i_allocate(int fd, off_t from, off_t to)
+{
+#ifdef HAVE_FALLOCATE
+    if (fallocate(fd, 0, from, to - from) == 0)
+    {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        return -1;
+    }
+#endif
+    return ftruncate(fd, to);
+}
+
+static MMAP_RETTYPE
+mm_i_reserve(size_t len, size_t align)
+{
+    char *addr, *base;
+    size_t extra = align > mm_pagesize ? align : 0;
+
+    len = MM_PAGE_CEIL(len);
+    addr = mmap(0, len + extra, PROT_NONE, MM_RESERVE, -1, 0);
+    if (addr == MAP_FAILED || !extra)
+    {
+        return addr;
+    }
+    base = (char *)(((uintptr_t)addr + align - 1) & ~(uintptr_t)(align - 1));
+    if (base > addr)
+    {
+        munmap(addr, base - addr);
+    }
+    if (addr + extra > base)
+    {
+        munmap(base + len, addr + extra - base);
+    }
+    return base;
+}
+
+static int
+mm_i_mlock(void *addr, size_t len, int flag)
+{
+#if defined(HAVE_MLOCK2) && defined(MLOCK_ONFAULT)
+    if (flag & MM_ONFAULT)
+    {
+        return mlock2(addr, len, MLOCK_ONFAULT);
+    }
+#endif
+    return mlock(addr, len);
+}
+
+static MMAP_RETTYPE
+mm_i_commit(mm_mmap *t, size_t len)
+{
+    char *addr = (char *)t->addr;
+    size_t beg, end;
+
+    if (len > t->len)
     {
-        if (lseek(fd, len - i_mm->t->len - 1, SEEK_END) == -1)
+        beg = MM_PAGE_FLOOR(t->len);
+        if (mmap(addr + beg, len - beg, t->pmode,
+                 t->vscope | MAP_FIXED | MM_MAP_POPULATE(t->flag),
+                 t->fd, t->offset + beg) == MAP_FAILED)
+        {
+            return MAP_FAILED;
+        }
+#ifdef MADV_NORMAL
+        if (t->advice && madvise(addr + beg, len - beg, t->advice) == -1)
+        {
+            rb_raise(rb_eArgError, "madvise(%d)", errno);
+        }
+#endif
+#ifdef MADV_HUGEPAGE
+        if ((t->flag & MM_THP) && madvise(addr + beg, len - beg, MADV_HUGEPAGE) == -1)
         {
-            rb_raise(rb_eIOError, "Can't lseek %lu", len - i_mm->t->len - 1);
+            rb_raise(rb_eArgError, "madvise(%d)", errno);
         }
-        if (write(fd, "\000", 1) != 1)
+#endif
+        if ((t->flag & MM_LOCK) && mm_i_mlock(addr + beg, len - beg, t->flag) == -1)
         {
-            rb_raise(rb_eIOError, "Can't extend %s", i_mm->t->path);
+            rb_raise(rb_eArgError, "mlock(%d)", errno);
         }
     }
-    else if (len < i_mm->t->len && truncate(i_mm->t->path, len) == -1)
+    else
     {
-        rb_raise(rb_eIOError, "Can't truncate %s", i_mm->t->path);
+        beg = MM_PAGE_CEIL(len);
+        end = MM_PAGE_CEIL(t->len);
+        if (beg < end &&
+            mmap(addr + beg, end - beg, PROT_NONE, MM_RESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            return MAP_FAILED;
+        }
     }
-    i_mm->t->addr = mmap(0, len, i_mm->t->pmode, i_mm->t->vscope, fd, i_mm->t->offset);
-    close(fd);
-    if (i_mm->t->addr == MAP_FAILED)
+    return t->addr;
+}
+
+static VALUE
+mm_i_expand(VALUE arg)
+{
+    mm_st *st_mm = (mm_st *)arg;
+    mm_ipc *i_mm = st_mm->i_mm;
+    size_t len = st_mm->len;
+    off_t fsize = i_mm->t->offset + len;
+    MMAP_RETTYPE addr;
+
+    if (i_mm->t->maxlen && len > i_mm->t->maxlen)
     {
-        rb_raise(rb_eArgError, "mmap failed");
+        rb_raise(rb_eArgError, "expand beyond max_size (%zu)", i_mm->t->maxlen);
     }
-#ifdef MADV_NORMAL
-    if (i_mm->t->advice && madvise(i_mm->t->addr, len, i_mm->t->advice) == -1)
+    if (i_mm->t->fd == -1 && (i_mm->t->fd = open(i_mm->t->path, i_mm->t->smode)) == -1)
     {
-        rb_raise(rb_eArgError, "madvise(%d)", errno);
+        rb_raise(rb_eArgError, "Can't open %s", i_mm->t->path);
+    }
+    if (len > i_mm->t->len &&
+        mm_i_allocate(i_mm->t->fd, i_mm->t->offset + i_mm->t->len, fsize) == -1)
+    {
+        rb_raise(rb_eIOError, "Can't extend %s", MM_PATH(i_mm->t));
+    }
+    if (i_mm->t->maxlen)
+    {
+        addr = mm_i_commit(i_mm->t, len);
+        if (addr == MAP_FAILED)
+        {
+            rb_raise(rb_eArgError, "mmap failed (%d)", errno);
+        }
     }
+    else
+    {
+#ifdef HAVE_MREMAP
+        addr = mremap(i_mm->t->addr, i_mm->t->len, len, MREMAP_MAYMOVE);
+        if (addr == MAP_FAILED)
+        {
+            rb_raise(rb_eArgError, "mremap failed (%d)", errno);
+        }
+        if ((i_mm->t->flag & MM_POPULATE) && len > i_mm->t->len)
+        {
+            size_t beg = MM_PAGE_FLOOR(i_mm->t->len);
+            mm_i_touch((char *)addr + beg, len - beg);
+        }
+#else
+        if (munmap(i_mm->t->addr, i_mm->t->len))
+        {
+            rb_raise(rb_eArgError, "munmap failed");
+        }
+        addr = mmap(0, len, i_mm->t->pmode, i_mm->t->vscope, i_mm->t->fd, i_mm->t->offset);
+        if (addr == MAP_FAILED)
+        {
+            rb_raise(rb_eArgError, "mmap failed");
+        }
+#ifdef MADV_NORMAL
+        if (i_mm->t->advice && madvise(addr, len, i_mm->t->advice) == -1)
+        {
+            rb_raise(rb_eArgError, "madvise(%d)", errno);
+        }
+#endif
+#ifdef MADV_HUGEPAGE
+        if ((i_mm->t->flag & MM_THP) && madvise(addr, len, MADV_HUGEPAGE) == -1)
+        {
+            rb_raise(rb_eArgError, "madvise(%d)", errno);
+        }
 #endif
-    if ((i_mm->t->flag & MM_LOCK) && mlock(i_mm->t->addr, len) == -1)
+        if ((i_mm->t->flag & MM_LOCK) && mm_i_mlock(addr, len, i_mm->t->flag) == -1)
+        {
+            rb_raise(rb_eArgError, "mlock(%d)", errno);
+        }
+#endif
+    }
+    i_mm->t->addr = addr;
+    if (len < i_mm->t->len && ftruncate(i_mm->t->fd, fsize) == -1)
     {
-        rb_raise(rb_eArgError, "mlock(%d)", errno);
+        i_mm->t->len = len;
+        rb_raise(rb_eIOError, "Can't truncate %s", MM_PATH(i_mm->t));
     }
     i_mm->t->len = len;
     return Qnil;
@@ -435,24 +1231,46 @@ mm_expandf(mm_ipc *i_mm, size_t len)
     int status;
     mm_st st_mm;
 
+    MM_CHECK_LOCKTMP(i_mm);
     if (i_mm->t->vscope == MAP_PRIVATE)
     {
         rb_raise(rb_eTypeError, "expand for a private map");
     }
+    /* with max_size the map grows in place */
+    if (!i_mm->t->maxlen || len < i_mm->t->len)
+    {
+        mm_i_detach_matches(i_mm);
+    }
     if (i_mm->t->flag & MM_FIXED)
     {
         rb_raise(rb_eTypeError, "expand for a fixed map");
     }
-    if (!i_mm->t->path || i_mm->t->path == (char *)-1)
+    if (!i_mm->t->path || (i_mm->t->path == (char *)-1 && i_mm->t->fd == -1))
     {
         rb_raise(rb_eTypeError, "expand for an anonymous map");
     }
+    if (i_mm->t->flag & MM_HUGETLB)
+    {
+        len = MM_HUGE_CEIL(len);
+        if (len == i_mm->t->len)
+        {
+            return;
+        }
+    }
     st_mm.i_mm = i_mm;
     st_mm.len = len;
-    if (i_mm->t->flag & MM_IPC)
+    if ((i_mm->t->flag & MM_IPC) || i_mm->flusher)
     {
         mm_lock(i_mm, Qtrue);
+        if (i_mm->flusher)
+        {
+            pthread_mutex_lock(&i_mm->flusher->io);
+        }
         rb_protect(mm_i_expand, (VALUE)&st_mm, &status);
+        if (i_mm->flusher)
+        {
+            pthread_mutex_unlock(&i_mm->flusher->io);
+        }
         mm_unlock(i_mm);
         if (status)
         {
@@ -470,9 +1288,24 @@ mm_realloc(mm_ipc *i_mm, size_t len)
 {
     if (len > i_mm->t->len)
     {
-        if ((len - i_mm->t->len) < i_mm->t->incr)
+        size_t incr = i_mm->t->incr;
+
+        if (i_mm->t->growth > 1.0)
+        {
+            size_t step = (size_t)(i_mm->t->len * (i_mm->t->growth - 1.0));
+
+            if (i_mm->t->gmax && step > i_mm->t->gmax)
+            {
+                step = i_mm->t->gmax;
+            }
+            if (step > incr)
+            {
+                incr = step;
+            }
+        }
+        if ((len - i_mm->t->len) < incr)
         {
-            len = i_mm->t->len + i_mm->t->incr;
+            len = i_mm->t->len + incr;
         }
         mm_expandf(i_mm, len);
     }
@@ -499,6 +1332,46 @@ mm_extend(VALUE obj, VALUE a)
     return ULONG2NUM(i_mm->t->len);
 }
 
+/*
+ * call-seq: reserve(count)
+ *
+ * make sure that at least <em>count</em> bytes can be appended without
+ * remapping the file. The space is preallocated on disk when possible
+ */
+static VALUE
+mm_reserve(VALUE obj, VALUE a)
+{
+    mm_ipc *i_mm;
+    long len;
+
+    GetMmap(obj, i_mm, MM_MODIFY);
+    len = NUM2LONG(a);
+    if (len < 0)
+    {
+        rb_raise(rb_eArgError, "negative size %ld", len);
+    }
+    if (i_mm->t->real + len > i_mm->t->len)
+    {
+        mm_expandf(i_mm, i_mm->t->real + len);
+    }
+    return ULONG2NUM(i_mm->t->len);
+}
+
+/*
+ * call-seq: capacity
+ *
+ * return the number of bytes currently mapped, including the space
+ * reserved for future appends
+ */
+static VALUE
+mm_capacity(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    return ULONG2NUM(i_mm->t->len);
+}
+
 static VALUE mm_set_ipc(VALUE self, VALUE value)
 {
     mm_ipc *i_mm;
@@ -531,6 +1404,35 @@ static VALUE mm_set_increment(VALUE self, VALUE value)
     return self;
 }
 
+static VALUE mm_set_growth(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    VALUE factor = value, max = Qnil;
+    Data_Get_Struct(self, mm_ipc, i_mm);
+
+    if (TYPE(value) == T_HASH)
+    {
+        factor = rb_hash_aref(value, ID2SYM(rb_intern("factor")));
+        max = rb_hash_aref(value, ID2SYM(rb_intern("max")));
+    }
+    i_mm->t->growth = NIL_P(factor) ? 2.0 : NUM2DBL(factor);
+    if (i_mm->t->growth < 1.0)
+    {
+        rb_raise(rb_eArgError, "Invalid value for growth %f", i_mm->t->growth);
+    }
+    if (!NIL_P(max))
+    {
+        long gmax = NUM2LONG(max);
+        if (gmax < 0)
+        {
+            rb_raise(rb_eArgError, "Invalid value for growth max %ld", gmax);
+        }
+        i_mm->t->gmax = gmax;
+    }
+
+    return self;
+}
+
 static VALUE mm_set_advice(VALUE self, VALUE value)
 {
     mm_ipc *i_mm;
@@ -541,89 +1443,227 @@ static VALUE mm_set_advice(VALUE self, VALUE value)
     return self;
 }
 
-static VALUE mm_set_offset(VALUE self, VALUE value)
+static VALUE mm_set_max_size(VALUE self, VALUE value)
 {
     mm_ipc *i_mm;
     Data_Get_Struct(self, mm_ipc, i_mm);
 
-    i_mm->t->offset = NUM2INT(value);
-    if (i_mm->t->offset < 0)
+    i_mm->t->maxlen = NUM2SIZET(value);
+    if (i_mm->t->maxlen == 0)
     {
-        rb_raise(rb_eArgError, "Invalid value for offset %lld", i_mm->t->offset);
+        rb_raise(rb_eArgError, "Invalid value for max_size %zu", i_mm->t->maxlen);
     }
-    i_mm->t->flag |= MM_FIXED;
+    i_mm->t->maxlen = MM_PAGE_CEIL(i_mm->t->maxlen);
 
     return self;
 }
 
-static VALUE mm_set_length(VALUE self, VALUE value)
+static VALUE mm_set_hugepages(VALUE self, VALUE value)
 {
     mm_ipc *i_mm;
+    ID mode;
     Data_Get_Struct(self, mm_ipc, i_mm);
 
-    i_mm->t->len = NUM2UINT(value);
-    if (i_mm->t->len <= 0)
+    mode = rb_to_id(value);
+    i_mm->t->flag &= ~(MM_THP | MM_HUGETLB);
+    if (mode == rb_intern("transparent"))
     {
-        rb_raise(rb_eArgError, "Invalid value for length %zu", i_mm->t->len);
+#ifndef MADV_HUGEPAGE
+        rb_raise(rb_eNotImpError, "transparent huge pages are not supported");
+#endif
+        i_mm->t->flag |= MM_THP;
+    }
+    else if (mode == rb_intern("explicit"))
+    {
+#ifndef MAP_HUGETLB
+        rb_raise(rb_eNotImpError, "explicit huge pages are not supported");
+#endif
+        i_mm->t->flag |= MM_HUGETLB;
+    }
+    else if (mode != rb_intern("off"))
+    {
+        rb_raise(rb_eArgError, "Invalid value for hugepages %s", rb_id2name(mode));
     }
-    i_mm->t->flag |= MM_FIXED;
 
     return self;
 }
 
-#if HAVE_SEMCTL && HAVE_SHMCTL
-
-static VALUE
-mm_i_ipc(VALUE arg, VALUE obj, int argc, const VALUE *argv, VALUE unused)
+static VALUE mm_set_populate(VALUE self, VALUE value)
 {
     mm_ipc *i_mm;
-    char *options;
-    VALUE key, value;
+    Data_Get_Struct(self, mm_ipc, i_mm);
 
-    Data_Get_Struct(obj, mm_ipc, i_mm);
-    key = rb_ary_entry(arg, 0);
-    value = rb_ary_entry(arg, 1);
-    key = rb_obj_as_string(key);
-    options = StringValuePtr(key);
-    if (strcmp(options, "key") == 0)
+    if (RTEST(value))
     {
-        i_mm->t->key = rb_funcall2(value, rb_intern("to_int"), 0, 0);
+        i_mm->t->flag |= MM_POPULATE;
     }
-    else if (strcmp(options, "permanent") == 0)
+    else
     {
-        if (RTEST(value))
-        {
-            i_mm->t->flag &= ~MM_TMP;
-        }
+        i_mm->t->flag &= ~MM_POPULATE;
     }
-    else if (strcmp(options, "mode") == 0)
+
+    return self;
+}
+
+static VALUE mm_set_window(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    Data_Get_Struct(self, mm_ipc, i_mm);
+
+    i_mm->t->wsize = NUM2SIZET(value);
+    if (i_mm->t->wsize == 0)
     {
-        i_mm->t->semid = NUM2INT(value);
+        rb_raise(rb_eArgError, "Invalid value for window %zu", i_mm->t->wsize);
     }
-    else
+    i_mm->t->wsize = MM_PAGE_CEIL(i_mm->t->wsize);
+    if (!i_mm->t->wcount)
     {
-        rb_warning("Unknown option `%s'", options);
+        i_mm->t->wcount = 4;
     }
-    return Qnil;
+    i_mm->t->flag |= MM_WINDOW | MM_FIXED;
+
+    return self;
 }
 
-#endif
+static VALUE mm_set_windows(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    Data_Get_Struct(self, mm_ipc, i_mm);
 
-/*
- * call-seq:
- *  new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
- *
- * create a new Mmap object
- *
- * * <em>file</em>
- *
- *   Pathname of the file, if <em>nil</em> is given an anonymous map
- *   is created <em>Mmanp::MAP_ANON</em>
- *
- * * <em>mode</em>
- *
- *   Mode to open the file, it can be "r", "w", "rw", "a"
- *
+    i_mm->t->wcount = NUM2INT(value);
+    if (i_mm->t->wcount <= 0)
+    {
+        rb_raise(rb_eArgError, "Invalid value for windows %d", i_mm->t->wcount);
+    }
+
+    return self;
+}
+
+static VALUE mm_set_flush_interval(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    double interval;
+    Data_Get_Struct(self, mm_ipc, i_mm);
+
+    interval = NUM2DBL(value);
+    if (interval <= 0)
+    {
+        rb_raise(rb_eArgError, "Invalid value for flush_interval %f", interval);
+    }
+    mm_i_flusher_new(i_mm)->interval = interval;
+
+    return self;
+}
+
+static int
+mm_i_editing(VALUE value)
+{
+    if (value == ID2SYM(rb_intern("gap")))
+    {
+        return MM_GAP;
+    }
+    if (value != ID2SYM(rb_intern("direct")))
+    {
+        rb_raise(rb_eArgError, "Invalid value for editing, :gap or :direct expected");
+    }
+    return 0;
+}
+
+static VALUE mm_set_editing(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    Data_Get_Struct(self, mm_ipc, i_mm);
+
+    i_mm->t->flag = (i_mm->t->flag & ~MM_GAP) | mm_i_editing(value);
+
+    return self;
+}
+
+static VALUE mm_set_offset(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    Data_Get_Struct(self, mm_ipc, i_mm);
+
+    i_mm->t->offset = NUM2OFFT(value);
+    if (i_mm->t->offset < 0)
+    {
+        rb_raise(rb_eArgError, "Invalid value for offset %lld", i_mm->t->offset);
+    }
+    i_mm->t->flag |= MM_FIXED;
+
+    return self;
+}
+
+static VALUE mm_set_length(VALUE self, VALUE value)
+{
+    mm_ipc *i_mm;
+    Data_Get_Struct(self, mm_ipc, i_mm);
+
+    i_mm->t->len = NUM2SIZET(value);
+    if (i_mm->t->len == 0)
+    {
+        rb_raise(rb_eArgError, "Invalid value for length %zu", i_mm->t->len);
+    }
+    i_mm->t->flag |= MM_FIXED;
+
+    return self;
+}
+
+#if HAVE_SEMCTL && HAVE_SHMCTL
+
+static VALUE
+mm_i_ipc(VALUE arg, VALUE obj, int argc, const VALUE *argv, VALUE unused)
+{
+    mm_ipc *i_mm;
+    char *options;
+    VALUE key, value;
+
+    Data_Get_Struct(obj, mm_ipc, i_mm);
+    key = rb_ary_entry(arg, 0);
+    value = rb_ary_entry(arg, 1);
+    key = rb_obj_as_string(key);
+    options = StringValuePtr(key);
+    if (strcmp(options, "key") == 0)
+    {
+        i_mm->t->key = rb_funcall2(value, rb_intern("to_int"), 0, 0);
+    }
+    else if (strcmp(options, "permanent") == 0)
+    {
+        if (RTEST(value))
+        {
+            i_mm->t->flag &= ~MM_TMP;
+        }
+    }
+    else if (strcmp(options, "mode") == 0)
+    {
+        i_mm->t->semid = NUM2INT(value);
+    }
+    else
+    {
+        rb_warning("Unknown option `%s'", options);
+    }
+    return Qnil;
+}
+
+#endif
+
+/*
+ * call-seq:
+ *  new(file, mode = "r", protection = Mmap::MAP_SHARED, options = {})
+ *
+ * create a new Mmap object
+ *
+ * * <em>file</em>
+ *
+ *   Pathname of the file, if <em>nil</em> is given an anonymous map
+ *   is created <em>Mmanp::MAP_ANON</em>. Unless <em>length</em> or
+ *   <em>offset</em> is given, a shared anonymous map is backed by a
+ *   memfd and can grow and shrink like a file map
+ *
+ * * <em>mode</em>
+ *
+ *   Mode to open the file, it can be "r", "w", "rw", "a"
+ *
  * * <em>protection</em>
  *
  *   specify the nature of the mapping
@@ -645,11 +1685,39 @@ mm_i_ipc(VALUE arg, VALUE obj, int argc, const VALUE *argv, VALUE unused)
  *   is specified it will not possible to modify the size of
  *   the mapped file.
  *
- *   length:: maps <em>length</em> bytes from the file
+ *   length:: maps <em>length</em> bytes from the file, by default
+ *            everything from <em>offset</em> to the end of the file
  *
- *   offset:: the mapping begin at <em>offset</em>
+ *   offset:: the mapping begin at <em>offset</em>, which need not be
+ *            a multiple of the page size
  *
  *   advice:: the type of the access (see #madvise)
+ *
+ *   increment:: minimum number of bytes added when the file is expanded
+ *
+ *   growth:: expand the file geometrically by this factor, e.g. 1.5 or 2.
+ *   A Hash <em>{factor: 2, max: 64 << 20}</em> also caps each step
+ *
+ *   max_size:: reserve this much address space up front, the map can
+ *   then grow up to <em>max_size</em> without ever changing its address
+ *
+ *   hugepages:: <em>:transparent</em> aligns the map and advises
+ *   MADV_HUGEPAGE, <em>:explicit</em> uses MAP_HUGETLB for an anonymous
+ *   map, <em>:off</em> is the default
+ *
+ *   populate:: prefault the whole map with MAP_POPULATE, and every
+ *   range added when the map grows
+ *
+ *   window:: for a file opened with mode "r", map at most
+ *   <em>windows</em> (default 4) regions of twice this size at a time.
+ *   #[], #index and the iterators remap them on demand, evicting the
+ *   least recently used one
+ *
+ *   flush_interval:: write back the map from a native thread every
+ *   <em>flush_interval</em> seconds, see #flushed_offset
+ *
+ *   editing:: <em>:gap</em> for many inserts and deletes in the middle
+ *   of the map, see #editing=
  */
 
 static VALUE
@@ -658,9 +1726,12 @@ mm_s_alloc(VALUE obj)
     VALUE res;
     mm_ipc *i_mm;
 
-    res = Data_Make_Struct(obj, mm_ipc, 0, mm_free, i_mm);
+    res = Data_Make_Struct(obj, mm_ipc, mm_mark, mm_free, i_mm);
+    i_mm->view = Qnil;
+    i_mm->matches = Qnil;
     i_mm->t = ALLOC_N(mm_mmap, 1);
     MEMZERO(i_mm->t, mm_mmap, 1);
+    i_mm->t->fd = -1;
     i_mm->t->incr = EXP_INCR_SIZE;
     return res;
 }
@@ -679,7 +1750,8 @@ mm_init(int argc, VALUE *argv, VALUE obj)
     VALUE fname, fdv, vmode, scope, options;
     mm_ipc *i_mm;
     char *path, *mode;
-    size_t size = 0;
+    const char *invalid;
+    size_t size = 0, msize, delta;
     off_t offset;
     int anonymous;
 
@@ -813,13 +1885,15 @@ mm_init(int argc, VALUE *argv, VALUE obj)
     if (options != Qnil)
     {
         rb_funcall(obj, rb_intern("process_options"), 1, options);
-        if (path && ((off_t)i_mm->t->len + i_mm->t->offset) > st.st_size)
+        if (!anonymous && ((off_t)i_mm->t->len + i_mm->t->offset) > st.st_size)
         {
-            rb_raise(rb_eArgError, "invalid value for length (%ld) or offset (%lld)",
-                     i_mm->t->len, i_mm->t->offset);
+            rb_raise(rb_eArgError, "invalid value for length (%zu) or offset (%lld)",
+                     i_mm->t->len, (long long)i_mm->t->offset);
         }
         if (i_mm->t->len)
             size = i_mm->t->len;
+        else if (!anonymous)
+            size -= i_mm->t->offset;
         offset = i_mm->t->offset;
 #if HAVE_SEMCTL && HAVE_SHMCTL
         if (i_mm->t->flag & MM_IPC)
@@ -910,7 +1984,53 @@ mm_init(int argc, VALUE *argv, VALUE obj)
         }
 #endif
     }
+    invalid = NULL;
+    if (i_mm->flusher && smode == O_RDONLY)
+    {
+        invalid = "flush_interval needs a writable map";
+    }
+    else if ((i_mm->t->flag & MM_GAP) && (smode == O_RDONLY || (i_mm->t->flag & MM_IPC)))
+    {
+        invalid = "editing: :gap needs a writable map which is not shared";
+    }
+    else if ((i_mm->t->flag & MM_WINDOW) &&
+             (anonymous || smode != O_RDONLY || (i_mm->t->flag & MM_IPC)))
+    {
+        invalid = "window needs a file opened with mode \"r\"";
+    }
+    if (invalid)
+    {
+        /* the file opened here is not kept */
+        if (NIL_P(fdv) && fd != -1)
+        {
+            close(fd);
+        }
+        rb_raise(rb_eArgError, "%s", invalid);
+    }
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        if (!NIL_P(fdv) && (fd = dup(fd)) == -1)
+        {
+            rb_sys_fail("dup()");
+        }
+        i_mm->t->win = ALLOC_N(mm_window, i_mm->t->wcount);
+        MEMZERO(i_mm->t->win, mm_window, i_mm->t->wcount);
+        i_mm->t->fd = fd;
+        i_mm->t->addr = NULL;
+        i_mm->t->len = i_mm->t->real = size;
+        i_mm->t->delta = offset - MM_PAGE_FLOOR(offset);
+        i_mm->t->pmode = pmode;
+        i_mm->t->vscope = vscope;
+        i_mm->t->smode = smode;
+        i_mm->t->path = (path) ? ruby_strdup(path) : (char *)-1;
+        return obj;
+    }
     init = 0;
+    msize = size;
+    if ((i_mm->t->flag & MM_HUGETLB) && !anonymous)
+    {
+        rb_raise(rb_eArgError, "hugepages: :explicit needs an anonymous map");
+    }
     if (anonymous)
     {
         if (size <= 0)
@@ -924,43 +2044,112 @@ mm_init(int argc, VALUE *argv, VALUE obj)
         }
         smode = O_RDWR;
         pmode = PROT_READ | PROT_WRITE;
-        i_mm->t->flag |= MM_FIXED | MM_ANON;
+        i_mm->t->flag |= MM_ANON;
+#ifdef HAVE_MEMFD_CREATE
+        if (!(i_mm->t->flag & MM_FIXED) && (vscope & MAP_SHARED))
+        {
+            int mfd = MFD_CLOEXEC;
+
+#ifdef MFD_HUGETLB
+            if (i_mm->t->flag & MM_HUGETLB)
+            {
+                mfd |= MFD_HUGETLB;
+            }
+#endif
+            if ((fd = memfd_create("mmap", mfd)) == -1)
+            {
+                rb_sys_fail("memfd_create()");
+            }
+            msize = (i_mm->t->flag & MM_HUGETLB) ? MM_HUGE_CEIL(size) : size;
+            if (ftruncate(fd, msize) == -1)
+            {
+                close(fd);
+                rb_sys_fail("ftruncate()");
+            }
+            vscope &= ~MAP_ANON;
+        }
+        else
+#endif
+        {
+            i_mm->t->flag |= MM_FIXED;
+#ifdef MAP_HUGETLB
+            if (i_mm->t->flag & MM_HUGETLB)
+            {
+                msize = MM_HUGE_CEIL(size);
+                vscope |= MAP_HUGETLB;
+            }
+#endif
+        }
     }
     else
     {
         if (size == 0 && (smode & O_RDWR))
         {
-            if (lseek(fd, i_mm->t->incr - 1, SEEK_END) == -1)
-            {
-                rb_raise(rb_eIOError, "Can't lseek %lu", i_mm->t->incr - 1);
-            }
-            if (write(fd, "\000", 1) != 1)
+            if (ftruncate(fd, offset + i_mm->t->incr) == -1)
             {
                 rb_raise(rb_eIOError, "Can't extend %s", path);
             }
             init = 1;
-            size = i_mm->t->incr;
+            size = msize = i_mm->t->incr;
         }
         if (!NIL_P(fdv))
         {
             i_mm->t->flag |= MM_FIXED;
         }
     }
-    addr = mmap(0, size, pmode, vscope, fd, offset);
-    if (NIL_P(fdv) && !anonymous)
+    /* mmap() wants a page aligned offset, map from the page below it */
+    delta = offset - MM_PAGE_FLOOR(offset);
+    if (i_mm->t->maxlen || (i_mm->t->flag & MM_THP))
+    {
+        if (i_mm->t->maxlen && i_mm->t->maxlen < msize + delta)
+        {
+            rb_raise(rb_eArgError, "max_size (%zu) smaller than the map (%zu)",
+                     i_mm->t->maxlen, msize + delta);
+        }
+        addr = mm_i_reserve(i_mm->t->maxlen ? i_mm->t->maxlen : msize + delta,
+                            (i_mm->t->flag & MM_THP) ? mm_hugepagesize : mm_pagesize);
+        if (addr != MAP_FAILED &&
+            mmap(addr, msize + delta, pmode,
+                 vscope | MAP_FIXED | MM_MAP_POPULATE(i_mm->t->flag),
+                 fd, offset - delta) == MAP_FAILED)
+        {
+            munmap(addr, i_mm->t->maxlen ? i_mm->t->maxlen : msize + delta);
+            addr = MAP_FAILED;
+        }
+    }
+    else
+    {
+        addr = mmap(0, msize + delta, pmode, vscope | MM_MAP_POPULATE(i_mm->t->flag),
+                    fd, offset - delta);
+    }
+    if (NIL_P(fdv) && fd != -1)
     {
-        close(fd);
+        if (addr == MAP_FAILED || !addr || smode == O_RDONLY)
+        {
+            close(fd);
+        }
+        else
+        {
+            i_mm->t->fd = fd;
+        }
     }
     if (addr == MAP_FAILED || !addr)
     {
         rb_raise(rb_eArgError, "mmap failed (%d)", errno);
     }
 #ifdef MADV_NORMAL
-    if (i_mm->t->advice && madvise(addr, size, i_mm->t->advice) == -1)
+    if (i_mm->t->advice && madvise(addr, msize + delta, i_mm->t->advice) == -1)
+    {
+        rb_raise(rb_eArgError, "madvise(%d)", errno);
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if ((i_mm->t->flag & MM_THP) && madvise(addr, msize + delta, MADV_HUGEPAGE) == -1)
     {
         rb_raise(rb_eArgError, "madvise(%d)", errno);
     }
 #endif
+    addr = (char *)addr + delta;
     if (anonymous && TYPE(options) == T_HASH)
     {
         VALUE val;
@@ -974,9 +2163,11 @@ mm_init(int argc, VALUE *argv, VALUE obj)
         }
     }
     i_mm->t->addr = addr;
-    i_mm->t->len = size;
+    i_mm->t->len = msize;
+    i_mm->t->delta = delta;
     if (!init)
         i_mm->t->real = size;
+    i_mm->t->flushed = i_mm->t->real;
     i_mm->t->pmode = pmode;
     i_mm->t->vscope = vscope;
     i_mm->t->smode = smode & ~O_TRUNC;
@@ -991,6 +2182,10 @@ mm_init(int argc, VALUE *argv, VALUE obj)
         {
             i_mm->t->flag |= MM_FIXED;
         }
+        if (i_mm->flusher)
+        {
+            mm_i_flusher_start(i_mm);
+        }
     }
     return obj;
 }
@@ -998,121 +2193,368 @@ mm_init(int argc, VALUE *argv, VALUE obj)
 /*
  * Document-method: msync
  * Document-method: sync
- * Document-method: flush
  *
- * call-seq: msync
+ * call-seq:
+ *    msync(flag = Mmap::MS_SYNC)
+ *    msync(offset, length, flag = Mmap::MS_SYNC)
  *
- * flush the file
+ * flush the file, or only <em>length</em> bytes from <em>offset</em>.
+ * Slack left after the data by a previous expansion is only removed
+ * from the file by #munmap
  */
 static VALUE
 mm_msync(int argc, VALUE *argv, VALUE obj)
 {
     mm_ipc *i_mm;
-    VALUE oflag;
-    int ret;
-    int flag = MS_SYNC;
+    VALUE a, b, oflag;
+    size_t beg, end;
+    int i, ret, flag = MS_SYNC;
 
-    if (argc)
-    {
-        rb_scan_args(argc, argv, "01", &oflag);
-        flag = NUM2INT(oflag);
-    }
+    rb_scan_args(argc, argv, "03", &a, &b, &oflag);
     GetMmap(obj, i_mm, MM_MODIFY);
-    if ((ret = msync(i_mm->t->addr, i_mm->t->len, flag)) != 0)
-    {
-        rb_raise(rb_eArgError, "msync(%d)", ret);
-    }
-    if (i_mm->t->real < i_mm->t->len && i_mm->t->vscope != MAP_PRIVATE)
-        mm_expandf(i_mm, i_mm->t->real);
-    return obj;
-}
-
-/*
- * Document-method: mprotect
- * Document-method: protect
- *
- * call-seq: mprotect(mode)
- *
- * change the mode, value must be "r", "w" or "rw"
- */
-static VALUE
-mm_mprotect(VALUE obj, VALUE a)
-{
-    mm_ipc *i_mm;
-    int ret, pmode;
-    char *smode;
-
-    GetMmap(obj, i_mm, 0);
-    if (TYPE(a) == T_STRING)
+    MM_CHECK_WINDOW(i_mm);
+    if (argc < 2)
     {
-        smode = StringValuePtr(a);
-        if (strcmp(smode, "r") == 0)
-            pmode = PROT_READ;
-        else if (strcmp(smode, "w") == 0)
-            pmode = PROT_WRITE;
-        else if (strcmp(smode, "rw") == 0 || strcmp(smode, "wr") == 0)
-            pmode = PROT_READ | PROT_WRITE;
-        else
+        if (argc)
         {
-            rb_raise(rb_eArgError, "Invalid mode %s", smode);
+            flag = NUM2INT(a);
         }
+        beg = 0;
+        end = MM_SPAN(i_mm->t);
     }
     else
     {
-        pmode = NUM2INT(a);
+        long off = NUM2LONG(a), len = NUM2LONG(b);
+
+        if (!NIL_P(oflag))
+        {
+            flag = NUM2INT(oflag);
+        }
+        if (off < 0 || i_mm->t->len < (size_t)off || len < 0)
+        {
+            rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+        }
+        if (i_mm->t->len - off < (size_t)len)
+        {
+            len = i_mm->t->len - off;
+        }
+        beg = MM_PAGE_FLOOR(off + i_mm->t->delta);
+        end = off + len + i_mm->t->delta;
     }
-    if ((pmode & PROT_WRITE) && RB_OBJ_FROZEN(obj))
-        rb_check_frozen(obj);
-    if ((ret = mprotect(i_mm->t->addr, i_mm->t->len, pmode | PROT_READ)) != 0)
+    if (beg < end && (ret = msync(MM_BASE(i_mm->t) + beg, end - beg, flag)) != 0)
     {
-        rb_raise(rb_eArgError, "mprotect(%d)", ret);
+        rb_raise(rb_eArgError, "msync(%d)", errno);
     }
-    i_mm->t->pmode = pmode;
-    if (pmode & PROT_READ)
+    for (i = 0; i < i_mm->t->ndirty;)
     {
-        if (pmode & PROT_WRITE)
-            i_mm->t->smode = O_RDWR;
+        if (beg <= i_mm->t->dirty[i].beg && i_mm->t->dirty[i].end <= MM_PAGE_CEIL(end))
+        {
+            i_mm->t->dirty[i] = i_mm->t->dirty[--i_mm->t->ndirty];
+        }
         else
         {
-            i_mm->t->smode = O_RDONLY;
-            obj = rb_obj_freeze(obj);
+            i++;
         }
     }
-    else if (pmode & PROT_WRITE)
+    if (argc < 2 && (flag & MS_SYNC))
     {
-        i_mm->t->flag |= MM_FIXED;
-        i_mm->t->smode = O_WRONLY;
+        i_mm->t->flushed = i_mm->t->real;
     }
     return obj;
 }
 
-#ifdef MADV_NORMAL
+static void
+mm_i_flusher_check(mm_flusher *f)
+{
+    int err;
+
+    if (f && f->error)
+    {
+        err = f->error;
+        f->error = 0;
+        rb_raise(rb_eArgError, "msync(%d)", err);
+    }
+}
+
 /*
- * Document-method: madvise
- * Document-method: advise
- *
- * call-seq: madvise(advice)
- *
- * <em>advice</em> can have the value <em>Mmap::MADV_NORMAL</em>,
- * <em>Mmap::MADV_RANDOM</em>, <em>Mmap::MADV_SEQUENTIAL</em>,
- * <em>Mmap::MADV_WILLNEED</em>, <em>Mmap::MADV_DONTNEED</em>
+ * call-seq:
+ *    flush(flag = Mmap::MS_SYNC)
+ *    flush(async: true)
  *
+ * flush only the ranges modified since the last flush. With
+ * <em>async</em> the ranges are handed to a native thread which
+ * writes them back with sync_file_range() and fdatasync(), see
+ * #flushed_offset
  */
 static VALUE
-mm_madvise(VALUE obj, VALUE a)
+mm_flush(int argc, VALUE *argv, VALUE obj)
 {
     mm_ipc *i_mm;
-
-    GetMmap(obj, i_mm, 0);
-    if (madvise(i_mm->t->addr, i_mm->t->len, NUM2INT(a)) == -1)
+    mm_range *r;
+    mm_flusher *f;
+    VALUE oflag, opts, async = Qfalse;
+    ID id_async = rb_intern("async");
+    size_t span;
+    int i, flag = MS_SYNC;
+
+    rb_scan_args(argc, argv, "01:", &oflag, &opts);
+    if (!NIL_P(oflag))
     {
-        rb_raise(rb_eTypeError, "madvise(%d)", errno);
+        flag = NUM2INT(oflag);
     }
-    i_mm->t->advice = NUM2INT(a);
-    return Qnil;
-}
-#endif
-
+    if (!NIL_P(opts))
+    {
+        rb_get_kwargs(opts, &id_async, 0, 1, &async);
+    }
+    GetMmap(obj, i_mm, MM_MODIFY);
+    MM_CHECK_WINDOW(i_mm);
+    mm_i_flusher_check(i_mm->flusher);
+    if (RTEST(async) && async != Qundef)
+    {
+        f = mm_i_flusher_start(i_mm);
+        mm_lock(i_mm, Qtrue);
+        pthread_mutex_lock(&f->mutex);
+        for (i = 0; i < i_mm->t->ndirty; i++)
+        {
+            r = &i_mm->t->dirty[i];
+            mm_i_range_add(f->pending, &f->npending, r->beg, r->end);
+        }
+        f->target = i_mm->t->real;
+        pthread_cond_signal(&f->cond);
+        pthread_mutex_unlock(&f->mutex);
+        i_mm->t->ndirty = 0;
+        mm_unlock(i_mm);
+        return obj;
+    }
+    if (i_mm->flusher && i_mm->flusher->started)
+    {
+        rb_thread_call_without_gvl(mm_i_flusher_idle, i_mm->flusher, NULL, NULL);
+        mm_i_flusher_check(i_mm->flusher);
+    }
+    mm_lock(i_mm, Qtrue);
+    span = MM_SPAN(i_mm->t);
+    while (i_mm->t->ndirty)
+    {
+        r = &i_mm->t->dirty[i_mm->t->ndirty - 1];
+        if (r->beg < span &&
+            msync(MM_BASE(i_mm->t) + r->beg, (r->end < span ? r->end : span) - r->beg, flag) != 0)
+        {
+            mm_unlock(i_mm);
+            rb_raise(rb_eArgError, "msync(%d)", errno);
+        }
+        i_mm->t->ndirty--;
+    }
+    if (flag & MS_SYNC)
+    {
+        i_mm->t->flushed = i_mm->t->real;
+    }
+    mm_unlock(i_mm);
+    return obj;
+}
+
+/*
+ * call-seq: flushed_offset
+ *
+ * return the offset below which everything written before the last
+ * completed flush is on disk
+ */
+static VALUE
+mm_flushed_offset(VALUE obj)
+{
+    mm_ipc *i_mm;
+    size_t off;
+
+    GetMmap(obj, i_mm, 0);
+    mm_i_flusher_check(i_mm->flusher);
+    off = i_mm->t->flushed;
+    if (off > i_mm->t->real)
+    {
+        off = i_mm->t->real;
+    }
+    return SIZET2NUM(off);
+}
+
+/*
+ * call-seq: dirty_ranges
+ *
+ * return the ranges, as <em>[offset, length]</em> pairs rounded to
+ * the page size, modified since the last flush
+ */
+static VALUE
+mm_dirty_ranges(VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE res;
+    long beg;
+    int i;
+
+    GetMmap(obj, i_mm, 0);
+    res = rb_ary_new2(i_mm->t->ndirty);
+    for (i = 0; i < i_mm->t->ndirty; i++)
+    {
+        beg = (long)i_mm->t->dirty[i].beg - (long)i_mm->t->delta;
+        if (beg < 0)
+        {
+            beg = 0;
+        }
+        rb_ary_push(res, rb_assoc_new(LONG2NUM(beg),
+                                      SIZET2NUM(i_mm->t->dirty[i].end - i_mm->t->delta - beg)));
+    }
+    rb_ary_sort_bang(res);
+    return res;
+}
+
+/*
+ * Document-method: mprotect
+ * Document-method: protect
+ *
+ * call-seq: mprotect(mode)
+ *
+ * change the mode, value must be "r", "w" or "rw"
+ */
+static VALUE
+mm_mprotect(VALUE obj, VALUE a)
+{
+    mm_ipc *i_mm;
+    int ret, pmode;
+    char *smode;
+
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    MM_CHECK_LOCKTMP(i_mm);
+    if (TYPE(a) == T_STRING)
+    {
+        smode = StringValuePtr(a);
+        if (strcmp(smode, "r") == 0)
+            pmode = PROT_READ;
+        else if (strcmp(smode, "w") == 0)
+            pmode = PROT_WRITE;
+        else if (strcmp(smode, "rw") == 0 || strcmp(smode, "wr") == 0)
+            pmode = PROT_READ | PROT_WRITE;
+        else
+        {
+            rb_raise(rb_eArgError, "Invalid mode %s", smode);
+        }
+    }
+    else
+    {
+        pmode = NUM2INT(a);
+    }
+    if ((pmode & PROT_WRITE) && RB_OBJ_FROZEN(obj))
+        rb_check_frozen(obj);
+    if ((ret = mprotect(MM_BASE(i_mm->t), MM_SPAN(i_mm->t), pmode | PROT_READ)) != 0)
+    {
+        rb_raise(rb_eArgError, "mprotect(%d)", ret);
+    }
+    i_mm->t->pmode = pmode;
+    if (pmode & PROT_READ)
+    {
+        if (pmode & PROT_WRITE)
+            i_mm->t->smode = O_RDWR;
+        else
+        {
+            i_mm->t->smode = O_RDONLY;
+            obj = rb_obj_freeze(obj);
+        }
+    }
+    else if (pmode & PROT_WRITE)
+    {
+        i_mm->t->flag |= MM_FIXED;
+        i_mm->t->smode = O_WRONLY;
+    }
+    return obj;
+}
+
+#ifdef MADV_NORMAL
+/*
+ * Document-method: madvise
+ * Document-method: advise
+ *
+ * call-seq: madvise(advice, offset: 0, length: size - offset)
+ *
+ * <em>advice</em> can have the value <em>Mmap::MADV_NORMAL</em>,
+ * <em>Mmap::MADV_RANDOM</em>, <em>Mmap::MADV_SEQUENTIAL</em>,
+ * <em>Mmap::MADV_WILLNEED</em>, <em>Mmap::MADV_DONTNEED</em>, or
+ * one of the other MADV_* constants supported by the system.
+ *
+ * With <em>offset</em> or <em>length</em> only that part of the map
+ * is advised, widened to whole pages except for MADV_DONTNEED,
+ * MADV_FREE and MADV_REMOVE which only apply to the pages entirely
+ * inside the range. Only advice given for the whole map is kept
+ * when the map grows
+ */
+static VALUE
+mm_madvise(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    VALUE a, opts, range[2] = {Qundef, Qundef};
+    ID ids[2];
+    size_t beg, end, span;
+    int advice;
+
+    rb_scan_args(argc, argv, "1:", &a, &opts);
+    if (!NIL_P(opts))
+    {
+        ids[0] = rb_intern("offset");
+        ids[1] = rb_intern("length");
+        rb_get_kwargs(opts, ids, 0, 2, range);
+    }
+    advice = NUM2INT(a);
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    span = MM_SPAN(i_mm->t);
+    if (range[0] == Qundef && range[1] == Qundef)
+    {
+        beg = 0;
+        end = span;
+    }
+    else
+    {
+        long off = range[0] == Qundef ? 0 : NUM2LONG(range[0]);
+        long len = range[1] == Qundef ? (long)i_mm->t->len - off : NUM2LONG(range[1]);
+
+        if (off < 0 || i_mm->t->len < (size_t)off || len < 0)
+        {
+            rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+        }
+        if (i_mm->t->len - off < (size_t)len)
+        {
+            len = i_mm->t->len - off;
+        }
+        beg = off + i_mm->t->delta;
+        end = beg + len;
+        switch (advice)
+        {
+        case MADV_DONTNEED:
+#ifdef MADV_FREE
+        case MADV_FREE:
+#endif
+#ifdef MADV_REMOVE
+        case MADV_REMOVE:
+#endif
+            beg = MM_PAGE_CEIL(beg);
+            if (end < span)
+            {
+                end = MM_PAGE_FLOOR(end);
+            }
+            break;
+        default:
+            beg = MM_PAGE_FLOOR(beg);
+            break;
+        }
+    }
+    if (beg < end && madvise(MM_BASE(i_mm->t) + beg, end - beg, advice) == -1)
+    {
+        rb_raise(rb_eTypeError, "madvise(%d)", errno);
+    }
+    if (beg == 0 && end == span)
+    {
+        i_mm->t->advice = advice;
+    }
+    return Qnil;
+}
+#endif
+
 #define StringMmap(b, bp, bl)                                                \
     do                                                                       \
     {                                                                        \
@@ -1120,6 +2562,7 @@ mm_madvise(VALUE obj, VALUE a)
         {                                                                    \
             mm_ipc *b_mm;                                                    \
             GetMmap(b, b_mm, 0);                                             \
+            MM_CHECK_WINDOW(b_mm);                                           \
             bp = b_mm->t->addr;                                              \
             bl = b_mm->t->real;                                              \
         }                                                                    \
@@ -1130,6 +2573,53 @@ mm_madvise(VALUE obj, VALUE a)
         }                                                                    \
     } while (0);
 
+/*
+ * replace [beg, beg + len) with editing: :gap. The gap is moved to beg,
+ * which only moves the bytes between the previous edit and this one, it
+ * swallows the replaced bytes and the new ones are copied at its start.
+ * When it is too small the text after it is moved once to make room
+ */
+static void
+mm_i_gap_update(mm_ipc *i_mm, size_t beg, size_t len, const char *valp, size_t vall)
+{
+    mm_mmap *t = i_mm->t;
+    char *addr = t->addr;
+    size_t first = beg, grow;
+
+    if (t->gapsize == 0)
+    {
+        t->gap = beg;
+    }
+    else if (beg < t->gap)
+    {
+        memmove(addr + beg + t->gapsize, addr + beg, t->gap - beg);
+    }
+    else if (beg > t->gap)
+    {
+        memmove(addr + t->gap, addr + t->gap + t->gapsize, beg - t->gap);
+        first = t->gap;
+    }
+    t->gap = beg;
+    t->gapsize += len;
+    t->real -= len;
+    if (t->gapsize < vall)
+    {
+        grow = vall - t->gapsize + MM_GAP_MIN;
+        if (t->real + t->gapsize + grow > t->len)
+        {
+            mm_realloc(i_mm, t->real + t->gapsize + grow);
+            addr = t->addr;
+        }
+        memmove(addr + t->gap + t->gapsize + grow, addr + t->gap + t->gapsize, t->real - t->gap);
+        t->gapsize += grow;
+    }
+    memcpy(addr + t->gap, valp, vall);
+    t->gap += vall;
+    t->gapsize -= vall;
+    t->real += vall;
+    mm_i_dirty(t, first, t->gap);
+}
+
 static void
 mm_update(mm_ipc *str, long beg, long len, VALUE val)
 {
@@ -1166,6 +2656,16 @@ mm_update(mm_ipc *str, long beg, long len, VALUE val)
         mm_unlock(str);
         rb_raise(rb_eTypeError, "try to change the size of a fixed map");
     }
+    if (str->t->flag & MM_GAP)
+    {
+        mm_i_gap_update(str, beg, len, valp, vall);
+        mm_unlock(str);
+        return;
+    }
+    if (str->t->gapsize)
+    {
+        mm_i_gap_close(str->t);
+    }
     if (len < vall)
     {
         mm_realloc(str, str->t->real + vall - len);
@@ -1185,6 +2685,8 @@ mm_update(mm_ipc *str, long beg, long len, VALUE val)
     {
         memmove((char *)str->t->addr + beg, valp, vall);
     }
+    mm_i_dirty(str->t, beg, vall == len ? (size_t)(beg + vall)
+                                        : str->t->real + (vall > len ? vall - len : 0));
     str->t->real += vall - len;
     mm_unlock(str);
 }
@@ -1195,12 +2697,13 @@ mm_update(mm_ipc *str, long beg, long len, VALUE val)
  * return an index of the match
  */
 static VALUE
-mm_match(VALUE x, VALUE y)
+mm_match(VALUE obj, VALUE y)
 {
-    VALUE reg, res;
+    VALUE x, reg, res;
+    mm_ipc *i_mm;
     long start;
 
-    x = mm_str(x, MM_ORIGIN);
+    x = mm_str(obj, MM_ORIGIN);
     if (TYPE(y) == T_DATA && RDATA(y)->dfree == (RUBY_DATA_FUNC)mm_free)
     {
         y = mm_to_str(y);
@@ -1224,6 +2727,8 @@ mm_match(VALUE x, VALUE y)
         res = rb_funcall(y, rb_intern("=~"), 1, x);
         break;
     }
+    GetMmap(obj, i_mm, 0);
+    mm_i_track_match(i_mm, rb_backref_get());
     return res;
 }
 
@@ -1246,99 +2751,364 @@ get_pat(VALUE pat)
     return pat;
 }
 
-static long
-mm_correct_backref()
+/*
+ * the matches reference the map while it is scanned. Before the map is
+ * modified by the edit of [beg, end) with <em>val</em>, the last one
+ * stays on the map if the bytes of its groups, which start after
+ * <em>lo</em>, are left unchanged, the edit is then useless and
+ * mm_i_rebase_backref() must follow the other changes. Otherwise $~ gets
+ * its own copy of these bytes only
+ */
+static int
+mm_correct_backref(long lo, long beg, long end, VALUE val)
 {
-    VALUE match;
-    long i, start;
+    VALUE match, str;
+    long i, start, stop;
 
     match = rb_backref_get();
-    if (NIL_P(match))
-        return 0;
-    if (BEG(match, 0) == -1)
+    if (NIL_P(match) || BEG(match, 0) == -1)
         return 0;
+    str = RMATCH(match)->str;
     start = BEG(match, 0);
-    RMATCH(match)->str = rb_str_new(StringValuePtr(RMATCH(match)->str) + start,
-                                    END(match, 0) - start);
-    for (i = 0; i < RMATCH_REGS(match)->num_regs && BEG(match, i) != -1; i++)
+    stop = END(match, 0);
+    for (i = 1; i < RMATCH_REGS(match)->num_regs; i++)
+    {
+        if (BEG(match, i) != -1)
+        {
+            start = BEG(match, i) < start ? BEG(match, i) : start;
+            stop = END(match, i) > stop ? END(match, i) : stop;
+        }
+    }
+    if (start >= lo && RB_TYPE_P(val, T_STRING) && RSTRING_LEN(val) == end - beg &&
+        memcmp(RSTRING_PTR(str) + beg, RSTRING_PTR(val), end - beg) == 0)
+    {
+        return 1;
+    }
+    RB_OBJ_WRITE(match, &RMATCH(match)->str,
+                 rb_obj_freeze(rb_str_new(RSTRING_PTR(str) + start, stop - start)));
+    for (i = 0; i < RMATCH_REGS(match)->num_regs; i++)
     {
-        BEG(match, i) -= start;
-        END(match, i) -= start;
+        if (BEG(match, i) != -1)
+        {
+            BEG(match, i) -= start;
+            END(match, i) -= start;
+        }
     }
     rb_backref_set(match);
-    return start;
+    return 0;
 }
 
-static VALUE
-mm_sub_bang_int(VALUE arg)
+/*
+ * $~ kept by mm_correct_backref() moves with the bytes after it by
+ * <em>shift</em>, it is detached with the other matches
+ */
+static void
+mm_i_rebase_backref(VALUE obj, mm_ipc *i_mm, long shift)
 {
-    mm_bang *bang_st = (mm_bang *)arg;
-    int argc = bang_st->argc;
-    VALUE *argv = bang_st->argv;
-    VALUE obj = bang_st->obj;
-    VALUE pat, repl = Qnil, match, str, res;
-    struct re_registers *regs;
-    long start, iter = 0;
-    long plen;
-    mm_ipc *i_mm;
+    VALUE match = rb_backref_get();
+    long i;
 
-    if (argc == 1 && rb_block_given_p())
-    {
-        iter = 1;
-    }
-    else if (argc == 2)
-    {
-        repl = rb_str_to_str(argv[1]);
-    }
-    else
+    RB_OBJ_WRITE(match, &RMATCH(match)->str, mm_str(obj, MM_ORIGIN));
+    for (i = 0; i < RMATCH_REGS(match)->num_regs; i++)
     {
-        rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+        if (BEG(match, i) != -1)
+        {
+            BEG(match, i) += shift;
+            END(match, i) += shift;
+        }
     }
-    GetMmap(obj, i_mm, MM_MODIFY);
-    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
+    mm_i_track_match(i_mm, match);
+    rb_backref_set(match);
+}
 
-    pat = get_pat(argv[0]);
-    res = Qnil;
-    if (rb_reg_search(pat, str, 0, 0) >= 0)
+/*
+ * the matched part given to the block of sub! and gsub!, a copy so that
+ * the block can keep it after the map is modified
+ */
+static VALUE
+mm_i_nth_match(VALUE match)
+{
+    VALUE str = RMATCH(match)->str;
+
+    return rb_str_new(RSTRING_PTR(str) + BEG(match, 0), END(match, 0) - BEG(match, 0));
+}
+
+/*
+ * literal replacement : the positions of <em>from</em> are found with
+ * memmem(), the map is resized once and rewritten in one sweep, forward
+ * when it shrinks and backward when it grows. The scan and the rewrite
+ * do not use the ruby API and can run without the GVL
+ */
+typedef struct
+{
+    mm_ipc *i_mm;
+    char *addr;
+    size_t real;
+    const char *from, *to;
+    size_t flen, tlen;
+    size_t *pos, npos, capa;
+    char *buf;
+    int once, nogvl, nomem, locked, locktmp;
+} mm_literal;
+
+static void *
+mm_i_literal_scan(void *arg)
+{
+    mm_literal *st = (mm_literal *)arg;
+    const char *p, *end = st->addr + st->real;
+
+    for (p = st->addr; (size_t)(end - p) >= st->flen; p += st->flen)
     {
-        start = mm_correct_backref();
-        match = rb_backref_get();
-        regs = RMATCH_REGS(match);
-        if (iter)
+        p = memmem(p, end - p, st->from, st->flen);
+        if (!p)
         {
-            rb_match_busy(match);
-            repl = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
-            rb_backref_set(match);
+            break;
         }
-        else
+        if (st->npos == st->capa)
         {
-            RSTRING(str)->as.heap.ptr += start;
-            repl = rb_reg_regsub(repl, str, regs, match);
-            RSTRING(str)->as.heap.ptr -= start;
+            size_t capa = st->capa ? st->capa * 2 : 64;
+            size_t *pos = realloc(st->pos, capa * sizeof(size_t));
+
+            if (!pos)
+            {
+                st->nomem = 1;
+                break;
+            }
+            st->pos = pos;
+            st->capa = capa;
         }
-        plen = END(match, 0) - BEG(match, 0);
-        if (RSTRING_LEN(repl) > plen)
+        st->pos[st->npos++] = p - st->addr;
+        if (st->once)
         {
-            mm_realloc(i_mm, RSTRING_LEN(str) + RSTRING_LEN(repl) - plen);
-            RSTRING(str)->as.heap.ptr = i_mm->t->addr;
+            break;
         }
-        if (RSTRING_LEN(repl) != plen)
+    }
+    return NULL;
+}
+
+static void *
+mm_i_literal_rewrite(void *arg)
+{
+    mm_literal *st = (mm_literal *)arg;
+    char *addr = st->addr;
+    size_t i, from, to;
+    ssize_t delta = (ssize_t)st->tlen - (ssize_t)st->flen;
+
+    if (delta <= 0)
+    {
+        for (i = 0; i < st->npos; i++)
         {
-            if (i_mm->t->flag & MM_FIXED)
+            from = st->pos[i] + st->flen;
+            to = i + 1 < st->npos ? st->pos[i + 1] : st->real;
+            memcpy(addr + st->pos[i] + i * delta, st->to, st->tlen);
+            if (delta)
             {
-                rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+                memmove(addr + from + (i + 1) * delta, addr + from, to - from);
             }
-            memmove(RSTRING_PTR(str) + start + BEG(match, 0) + RSTRING_LEN(repl),
-                    RSTRING_PTR(str) + start + BEG(match, 0) + plen,
-                    RSTRING_LEN(str) - start - BEG(match, 0) - plen);
         }
-        memcpy(RSTRING_PTR(str) + start + BEG(match, 0),
-               RSTRING_PTR(repl), RSTRING_LEN(repl));
-        i_mm->t->real += RSTRING_LEN(repl) - plen;
-
-        res = obj;
     }
-    return res;
+    else
+    {
+        for (i = st->npos; i-- > 0;)
+        {
+            from = st->pos[i] + st->flen;
+            to = i + 1 < st->npos ? st->pos[i + 1] : st->real;
+            memmove(addr + from + (i + 1) * delta, addr + from, to - from);
+            memcpy(addr + st->pos[i] + i * delta, st->to, st->tlen);
+        }
+    }
+    return NULL;
+}
+
+static VALUE
+mm_i_literal(VALUE arg)
+{
+    mm_literal *st = (mm_literal *)arg;
+    mm_ipc *i_mm = st->i_mm;
+    size_t nreal, last;
+
+    st->addr = i_mm->t->addr;
+    st->real = i_mm->t->real;
+    if (st->nogvl)
+    {
+        /* the other threads can run but not modify, move or unmap the map */
+        i_mm->t->locktmp++;
+        st->locktmp = 1;
+        rb_thread_call_without_gvl(mm_i_literal_scan, st, NULL, NULL);
+        st->locktmp = 0;
+        i_mm->t->locktmp--;
+    }
+    else
+    {
+        mm_i_literal_scan(st);
+    }
+    if (st->nomem)
+    {
+        rb_memerror();
+    }
+    if (st->npos == 0)
+    {
+        return INT2FIX(0);
+    }
+    nreal = st->real + st->npos * (st->tlen - st->flen);
+    if (nreal != st->real && (i_mm->t->flag & MM_FIXED))
+    {
+        rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    if (nreal > i_mm->t->len)
+    {
+        mm_realloc(i_mm, nreal);
+    }
+    st->addr = i_mm->t->addr;
+    if (st->nogvl)
+    {
+        i_mm->t->locktmp++;
+        st->locktmp = 1;
+        rb_thread_call_without_gvl(mm_i_literal_rewrite, st, NULL, NULL);
+        st->locktmp = 0;
+        i_mm->t->locktmp--;
+    }
+    else
+    {
+        mm_i_literal_rewrite(st);
+    }
+    last = st->pos[st->npos - 1] + st->flen;
+    i_mm->t->real = nreal;
+    mm_i_dirty(i_mm->t, st->pos[0], nreal == st->real ? last : (nreal > st->real ? nreal : st->real));
+    return SIZET2NUM(st->npos);
+}
+
+static VALUE
+mm_i_literal_free(VALUE arg)
+{
+    mm_literal *st = (mm_literal *)arg;
+
+    free(st->pos);
+    xfree(st->buf);
+    if (st->locktmp)
+    {
+        st->i_mm->t->locktmp--;
+    }
+    if (st->locked)
+    {
+        mm_unlock(st->i_mm);
+    }
+    return Qnil;
+}
+
+/*
+ * a String pattern with a replacement without backslash is replaced
+ * literally, Qundef means that the generic path must be used
+ */
+static VALUE
+mm_i_literal_bang(VALUE obj, int argc, VALUE *argv, int once)
+{
+    mm_literal st;
+    VALUE from, repl;
+    size_t n;
+
+    if (argc != 2 || rb_block_given_p() || TYPE(argv[0]) != T_STRING || RSTRING_LEN(argv[0]) == 0)
+    {
+        return Qundef;
+    }
+    repl = rb_str_to_str(argv[1]);
+    if (memchr(RSTRING_PTR(repl), '\\', RSTRING_LEN(repl)))
+    {
+        return Qundef;
+    }
+    MEMZERO(&st, mm_literal, 1);
+    GetMmap(obj, st.i_mm, MM_MODIFY);
+    MM_CHECK_WINDOW(st.i_mm);
+    /* the map can move before the rewrite, parts of it are copied */
+    from = argv[0];
+    if (mm_i_inside(st.i_mm, from))
+    {
+        from = rb_str_new(RSTRING_PTR(from), RSTRING_LEN(from));
+    }
+    if (mm_i_inside(st.i_mm, repl))
+    {
+        repl = rb_str_new(RSTRING_PTR(repl), RSTRING_LEN(repl));
+    }
+    st.from = RSTRING_PTR(from);
+    st.flen = RSTRING_LEN(from);
+    st.to = RSTRING_PTR(repl);
+    st.tlen = RSTRING_LEN(repl);
+    st.once = once;
+    n = NUM2SIZET(rb_ensure(mm_i_literal, (VALUE)&st, mm_i_literal_free, (VALUE)&st));
+    RB_GC_GUARD(from);
+    RB_GC_GUARD(repl);
+    return n ? obj : Qnil;
+}
+
+static VALUE
+mm_sub_bang_int(VALUE arg)
+{
+    mm_bang *bang_st = (mm_bang *)arg;
+    int argc = bang_st->argc;
+    VALUE *argv = bang_st->argv;
+    VALUE obj = bang_st->obj;
+    VALUE pat, repl = Qnil, match, str, res;
+    struct re_registers *regs;
+    long iter = 0;
+    mm_ipc *i_mm;
+
+    res = mm_i_literal_bang(obj, argc, argv, 1);
+    if (res != Qundef)
+    {
+        return res;
+    }
+    if (argc == 1 && rb_block_given_p())
+    {
+        iter = 1;
+    }
+    else if (argc == 2)
+    {
+        repl = rb_str_to_str(argv[1]);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
+    }
+    GetMmap(obj, i_mm, MM_MODIFY);
+    /* the match references the read-only view of the map, without copy */
+    str = mm_str(obj, MM_ORIGIN);
+
+    pat = get_pat(argv[0]);
+    if (rb_reg_search(pat, str, 0, 0) < 0)
+    {
+        return Qnil;
+    }
+    match = rb_backref_get();
+    regs = RMATCH_REGS(match);
+    if (iter)
+    {
+        rb_match_busy(match);
+        repl = rb_obj_as_string(rb_yield(mm_i_nth_match(match)));
+        /* the block may hand back a part of the map, own it before the splice */
+        repl = rb_str_new(RSTRING_PTR(repl), RSTRING_LEN(repl));
+        rb_backref_set(match);
+        GetMmap(obj, i_mm, MM_MODIFY);
+        if (i_mm->t->addr != RSTRING_PTR(str) || i_mm->t->real != (size_t)RSTRING_LEN(str))
+        {
+            rb_raise(rb_eRuntimeError, "string modified");
+        }
+    }
+    else
+    {
+        repl = rb_reg_regsub(repl, str, regs, pat);
+        if (mm_i_inside(i_mm, repl))
+        {
+            repl = rb_str_new(RSTRING_PTR(repl), RSTRING_LEN(repl));
+        }
+    }
+    if (mm_correct_backref(0, BEG(match, 0), END(match, 0), repl))
+    {
+        /* the map is unchanged */
+        mm_i_rebase_backref(obj, i_mm, 0);
+        return obj;
+    }
+    mm_update(i_mm, BEG(match, 0), END(match, 0) - BEG(match, 0), repl);
+    return obj;
 }
 
 /*
@@ -1371,6 +3141,78 @@ mm_sub_bang(int argc, VALUE *argv, VALUE obj)
     return res;
 }
 
+typedef struct
+{
+    size_t beg, end;
+    const char *ptr;
+    size_t len;
+} mm_edit;
+
+/*
+ * replace the sorted, non overlapping ranges [beg, end) of the map with
+ * the bytes of each edit. The map is resized once, the parts which move
+ * to the left are copied in ascending order, those which move to the
+ * right in descending order, then the replacements are written
+ */
+static void
+mm_i_splice(mm_ipc *i_mm, const mm_edit *edits, long n)
+{
+    size_t real = i_mm->t->real, nreal = real, from, to;
+    ssize_t shift, total = 0;
+    char *addr;
+    long i;
+
+    if (n == 0)
+    {
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        total += (ssize_t)edits[i].len - (ssize_t)(edits[i].end - edits[i].beg);
+    }
+    nreal += total;
+    if (nreal != real && (i_mm->t->flag & MM_FIXED))
+    {
+        rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    if (nreal > i_mm->t->len)
+    {
+        mm_realloc(i_mm, nreal);
+    }
+    addr = i_mm->t->addr;
+    if (total != 0)
+    {
+        /* the part after the edit i moves by the sum of the deltas up to i */
+        for (shift = 0, i = 0; i < n; i++)
+        {
+            shift += (ssize_t)edits[i].len - (ssize_t)(edits[i].end - edits[i].beg);
+            if (shift < 0)
+            {
+                from = edits[i].end;
+                to = i + 1 < n ? edits[i + 1].beg : real;
+                memmove(addr + from + shift, addr + from, to - from);
+            }
+        }
+        for (shift = total, i = n - 1; i >= 0; i--)
+        {
+            if (shift > 0)
+            {
+                from = edits[i].end;
+                to = i + 1 < n ? edits[i + 1].beg : real;
+                memmove(addr + from + shift, addr + from, to - from);
+            }
+            shift -= (ssize_t)edits[i].len - (ssize_t)(edits[i].end - edits[i].beg);
+        }
+    }
+    for (shift = 0, i = 0; i < n; i++)
+    {
+        memcpy(addr + edits[i].beg + shift, edits[i].ptr, edits[i].len);
+        shift += (ssize_t)edits[i].len - (ssize_t)(edits[i].end - edits[i].beg);
+    }
+    i_mm->t->real = nreal;
+    mm_i_dirty(i_mm->t, edits[0].beg, total ? (real > nreal ? real : nreal) : edits[n - 1].end);
+}
+
 static VALUE
 mm_gsub_bang_int(VALUE arg)
 {
@@ -1378,13 +3220,20 @@ mm_gsub_bang_int(VALUE arg)
     int argc = bang_st->argc;
     VALUE *argv = bang_st->argv;
     VALUE obj = bang_st->obj;
-    VALUE pat, val, repl = Qnil, match, str;
+    VALUE pat, val, repl = Qnil, match, str, vals, buf;
     struct re_registers *regs;
+    mm_edit edit, *edits;
     long beg, offset;
-    long start, iter = 0;
-    long plen;
+    long iter = 0;
+    long i, n;
+    size_t real;
     mm_ipc *i_mm;
 
+    val = mm_i_literal_bang(obj, argc, argv, 0);
+    if (val != Qundef)
+    {
+        return val;
+    }
     if (argc == 1 && rb_block_given_p())
     {
         iter = 1;
@@ -1398,67 +3247,88 @@ mm_gsub_bang_int(VALUE arg)
         rb_raise(rb_eArgError, "wrong # of arguments(%d for 2)", argc);
     }
     GetMmap(obj, i_mm, MM_MODIFY);
-    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
+    /* the matches reference the read-only view of the map, without copy */
+    str = mm_str(obj, MM_ORIGIN);
 
     pat = get_pat(argv[0]);
-    offset = 0;
     beg = rb_reg_search(pat, str, 0, 0);
     if (beg < 0)
     {
         return Qnil;
     }
+    /* collect every match and its replacement, the map is not modified */
+    vals = rb_ary_new();
+    buf = rb_str_buf_new(0);
     while (beg >= 0)
     {
-        start = mm_correct_backref();
         match = rb_backref_get();
         regs = RMATCH_REGS(match);
         if (iter)
         {
             rb_match_busy(match);
-            val = rb_obj_as_string(rb_yield(rb_reg_nth_match(0, match)));
+            val = rb_obj_as_string(rb_yield(mm_i_nth_match(match)));
+            val = rb_str_new(RSTRING_PTR(val), RSTRING_LEN(val));
             rb_backref_set(match);
+            GetMmap(obj, i_mm, MM_MODIFY);
+            if (i_mm->t->addr != RSTRING_PTR(str) || i_mm->t->real != (size_t)RSTRING_LEN(str))
+            {
+                rb_raise(rb_eRuntimeError, "string modified");
+            }
         }
         else
         {
-            RSTRING(str)->as.heap.ptr += start;
-            val = rb_reg_regsub(repl, str, regs, match);
-            RSTRING(str)->as.heap.ptr -= start;
-        }
-        plen = END(match, 0) - BEG(match, 0);
-        if ((i_mm->t->real + RSTRING_LEN(val) - plen) > i_mm->t->len)
-        {
-            mm_realloc(i_mm, RSTRING_LEN(str) + RSTRING_LEN(val) - plen);
-        }
-        if (RSTRING_LEN(val) != plen)
-        {
-            if (i_mm->t->flag & MM_FIXED)
+            /* without backslash the replacement itself, maybe the map */
+            val = rb_reg_regsub(repl, str, regs, pat);
+            if (mm_i_inside(i_mm, val))
             {
-                rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+                val = rb_str_new(RSTRING_PTR(val), RSTRING_LEN(val));
             }
-            memmove(RSTRING_PTR(str) + start + BEG(match, 0) + RSTRING_LEN(val),
-                    RSTRING_PTR(str) + start + BEG(match, 0) + plen,
-                    RSTRING_LEN(str) - start - BEG(match, 0) - plen);
         }
-        memcpy(RSTRING_PTR(str) + start + BEG(match, 0),
-               RSTRING_PTR(val), RSTRING_LEN(val));
-        RSTRING(str)->len += RSTRING_LEN(val) - plen;
-
-        i_mm->t->real = RSTRING_LEN(str);
+        rb_ary_push(vals, val);
+        edit.beg = BEG(match, 0);
+        edit.end = END(match, 0);
+        edit.ptr = NULL;
+        edit.len = 0;
+        rb_str_cat(buf, (const char *)&edit, sizeof(edit));
         if (BEG(match, 0) == END(match, 0))
         {
-            long end_pos = END(match, 0);
-            offset = start + end_pos + rb_enc_mbclen(RSTRING_PTR(str) + end_pos, RSTRING_END(str), rb_enc_get(str));
-            offset += RSTRING_LEN(val) - plen;
+            if (edit.end >= (size_t)RSTRING_LEN(str))
+            {
+                break;
+            }
+            offset = edit.end + rb_enc_mbclen(RSTRING_PTR(str) + edit.end, RSTRING_END(str), rb_enc_get(str));
         }
         else
         {
-            offset = start + END(match, 0) + RSTRING_LEN(val) - plen;
+            offset = edit.end;
         }
         if (offset > RSTRING_LEN(str))
             break;
         beg = rb_reg_search(pat, str, offset, 0);
     }
+    /* then rewrite the map in one sweep */
+    edits = (mm_edit *)RSTRING_PTR(buf);
+    n = RSTRING_LEN(buf) / sizeof(mm_edit);
+    for (i = 0; i < n; i++)
+    {
+        val = RARRAY_AREF(vals, i);
+        edits[i].ptr = RSTRING_PTR(val);
+        edits[i].len = RSTRING_LEN(val);
+    }
     rb_backref_set(match);
+    real = i_mm->t->real;
+    if (mm_correct_backref(n > 1 ? (long)edits[n - 2].end : 0, edits[n - 1].beg, edits[n - 1].end,
+                           RARRAY_AREF(vals, n - 1)))
+    {
+        mm_i_splice(i_mm, edits, n - 1);
+        mm_i_rebase_backref(obj, i_mm, (long)(i_mm->t->real - real));
+    }
+    else
+    {
+        mm_i_splice(i_mm, edits, n);
+    }
+    RB_GC_GUARD(vals);
+    RB_GC_GUARD(buf);
     return obj;
 }
 
@@ -1492,6 +3362,170 @@ mm_gsub_bang(int argc, VALUE *argv, VALUE obj)
     return res;
 }
 
+/*
+ * call-seq: replace_all(from, to)
+ *
+ * replace every occurrence of the String <em>from</em> with the String
+ * <em>to</em>, without interpretation of <em>to</em>. The search and the
+ * copy run without the GVL, in the meantime the other threads which
+ * modify, move or unmap the map get a RuntimeError. Return the number
+ * of replacements
+ */
+static VALUE
+mm_replace_all(VALUE obj, VALUE from, VALUE to)
+{
+    mm_literal st;
+
+    from = rb_str_to_str(from);
+    to = rb_str_to_str(to);
+    if (RSTRING_LEN(from) == 0)
+    {
+        rb_raise(rb_eArgError, "empty search string");
+    }
+    MEMZERO(&st, mm_literal, 1);
+    GetMmap(obj, st.i_mm, MM_MODIFY);
+    MM_CHECK_WINDOW(st.i_mm);
+    /* private copies, the strings can move while the GVL is released */
+    st.buf = ALLOC_N(char, RSTRING_LEN(from) + RSTRING_LEN(to));
+    memcpy(st.buf, RSTRING_PTR(from), RSTRING_LEN(from));
+    memcpy(st.buf + RSTRING_LEN(from), RSTRING_PTR(to), RSTRING_LEN(to));
+    st.from = st.buf;
+    st.flen = RSTRING_LEN(from);
+    st.to = st.buf + st.flen;
+    st.tlen = RSTRING_LEN(to);
+    st.nogvl = 1;
+    mm_lock(st.i_mm, Qtrue);
+    st.locked = 1;
+    return rb_ensure(mm_i_literal, (VALUE)&st, mm_i_literal_free, (VALUE)&st);
+}
+
+typedef struct
+{
+    mm_edit edit;
+    long idx;
+} mm_sorted_edit;
+
+static int
+mm_i_edit_cmp(const void *a, const void *b, void *data)
+{
+    const mm_sorted_edit *ea = a, *eb = b;
+
+    if (ea->edit.beg != eb->edit.beg)
+    {
+        return ea->edit.beg < eb->edit.beg ? -1 : 1;
+    }
+    return ea->idx < eb->idx ? -1 : ea->idx > eb->idx;
+}
+
+typedef struct
+{
+    VALUE obj, edits;
+} mm_apply;
+
+static VALUE
+mm_i_apply_edits(VALUE arg)
+{
+    mm_apply *st = (mm_apply *)arg;
+    mm_sorted_edit *sorted;
+    mm_edit *edits;
+    mm_ipc *i_mm;
+    VALUE entry, repl, repls, buf, sbuf, begs, ends, shifts;
+    long i, n, off, len;
+    ssize_t shift = 0;
+
+    GetMmap(st->obj, i_mm, MM_MODIFY);
+    n = RARRAY_LEN(st->edits);
+    sbuf = rb_str_buf_new(n * sizeof(mm_sorted_edit));
+    repls = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++)
+    {
+        mm_sorted_edit se;
+
+        entry = rb_check_array_type(RARRAY_AREF(st->edits, i));
+        if (NIL_P(entry) || RARRAY_LEN(entry) != 3)
+        {
+            rb_raise(rb_eTypeError, "edit %ld is not [offset, length, replacement]", i);
+        }
+        off = NUM2LONG(RARRAY_AREF(entry, 0));
+        len = NUM2LONG(RARRAY_AREF(entry, 1));
+        repl = rb_str_to_str(RARRAY_AREF(entry, 2));
+        if (off < 0 || i_mm->t->real < (size_t)off || len < 0)
+        {
+            rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+        }
+        if (i_mm->t->real - off < (size_t)len)
+        {
+            len = i_mm->t->real - off;
+        }
+        se.edit.beg = off;
+        se.edit.end = off + len;
+        se.edit.ptr = NULL;
+        se.edit.len = RSTRING_LEN(repl);
+        se.idx = i;
+        rb_ary_push(repls, repl);
+        rb_str_cat(sbuf, (const char *)&se, sizeof(se));
+    }
+    sorted = (mm_sorted_edit *)RSTRING_PTR(sbuf);
+    ruby_qsort(sorted, n, sizeof(mm_sorted_edit), mm_i_edit_cmp, NULL);
+    buf = rb_str_buf_new(n * sizeof(mm_edit));
+    begs = rb_ary_new_capa(n);
+    ends = rb_ary_new_capa(n);
+    shifts = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++)
+    {
+        if (i && sorted[i].edit.beg < sorted[i - 1].edit.end)
+        {
+            rb_raise(rb_eArgError, "overlapping edits at %ld", (long)sorted[i].edit.beg);
+        }
+        rb_str_cat(buf, (const char *)&sorted[i].edit, sizeof(mm_edit));
+        shift += (ssize_t)sorted[i].edit.len - (ssize_t)(sorted[i].edit.end - sorted[i].edit.beg);
+        rb_ary_push(begs, SIZET2NUM(sorted[i].edit.beg));
+        rb_ary_push(ends, SIZET2NUM(sorted[i].edit.end));
+        rb_ary_push(shifts, SSIZET2NUM(shift));
+    }
+    edits = (mm_edit *)RSTRING_PTR(buf);
+    for (i = 0; i < n; i++)
+    {
+        edits[i].ptr = RSTRING_PTR(RARRAY_AREF(repls, sorted[i].idx));
+    }
+    mm_i_splice(i_mm, edits, n);
+    RB_GC_GUARD(repls);
+    RB_GC_GUARD(sbuf);
+    RB_GC_GUARD(buf);
+    return rb_assoc_new(SIZET2NUM(i_mm->t->real),
+                        rb_funcall(rb_const_get(mm_cMap, rb_intern("OffsetMap")), rb_intern("new"), 3,
+                                   begs, ends, shifts));
+}
+
+/*
+ * call-seq: apply_edits([[offset, length, replacement], ...])
+ *
+ * replace each range <em>offset</em>, <em>length</em> (given in the
+ * offsets of the map before the call) with <em>replacement</em>. The
+ * edits are sorted and must not overlap, the map is resized once and
+ * rewritten in one sweep under one lock.
+ *
+ * Return the new size and a Mmap::OffsetMap which translates the old
+ * offsets into the new ones
+ */
+static VALUE
+mm_apply_edits(VALUE obj, VALUE edits)
+{
+    mm_ipc *i_mm;
+    mm_apply st;
+
+    GetMmap(obj, i_mm, MM_MODIFY);
+    MM_CHECK_WINDOW(i_mm);
+    st.obj = obj;
+    st.edits = rb_convert_type(edits, T_ARRAY, "Array", "to_ary");
+    if (i_mm->t->flag & MM_IPC)
+    {
+        mm_lock(i_mm, Qtrue);
+        return rb_ensure(mm_i_apply_edits, (VALUE)&st, mm_vunlock, obj);
+    }
+    return mm_i_apply_edits((VALUE)&st);
+}
+
 static VALUE mm_index __((int, VALUE *, VALUE));
 
 #if HAVE_RB_DEFINE_ALLOC_FUNC
@@ -1502,7 +3536,8 @@ static void mm_subpat_set(VALUE obj, VALUE re, int offset, VALUE val)
     long start, end, len;
     mm_ipc *i_mm;
 
-    str = mm_str(obj, MM_MODIFY | MM_ORIGIN);
+    GetMmap(obj, i_mm, MM_MODIFY);
+    str = mm_str(obj, MM_ORIGIN);
     if (rb_reg_search(re, str, 0, 0) < 0)
     {
         rb_raise(rb_eIndexError, "regexp not matched");
@@ -1520,7 +3555,11 @@ static void mm_subpat_set(VALUE obj, VALUE re, int offset, VALUE val)
     }
     end = END(match, offset);
     len = end - start;
-    GetMmap(obj, i_mm, MM_MODIFY);
+    if (mm_correct_backref(0, start, end, val))
+    {
+        mm_i_rebase_backref(obj, i_mm, 0);
+        return;
+    }
     mm_update(i_mm, start, len, val);
 }
 
@@ -1532,7 +3571,7 @@ mm_aset(VALUE str, VALUE indx, VALUE val)
     long idx;
     mm_ipc *i_mm;
 
-    GetMmap(str, i_mm, MM_MODIFY);
+    GetMmap(str, i_mm, MM_MODIFY | MM_KEEPGAP);
     switch (TYPE(indx))
     {
     case T_FIXNUM:
@@ -1553,7 +3592,12 @@ mm_aset(VALUE str, VALUE indx, VALUE val)
                 i_mm->t->real += 1;
                 mm_realloc(i_mm, i_mm->t->real);
             }
+            if ((size_t)idx >= i_mm->t->gap)
+            {
+                idx += i_mm->t->gapsize;
+            }
             ((char *)i_mm->t->addr)[idx] = NUM2INT(val) & 0xff;
+            mm_i_dirty(i_mm->t, idx, idx + 1);
         }
         else
         {
@@ -1624,7 +3668,7 @@ mm_aset_m(int argc, VALUE *argv, VALUE str)
 {
     mm_ipc *i_mm;
 
-    GetMmap(str, i_mm, MM_MODIFY);
+    GetMmap(str, i_mm, MM_MODIFY | MM_KEEPGAP);
     if (argc == 3)
     {
         long beg, len;
@@ -1663,10 +3707,10 @@ mm_insert(VALUE str, VALUE idx, VALUE str2)
     mm_ipc *i_mm;
     long pos = NUM2LONG(idx);
 
-    GetMmap(str, i_mm, MM_MODIFY);
+    GetMmap(str, i_mm, MM_MODIFY | MM_KEEPGAP);
     if (pos == -1)
     {
-        pos = RSTRING_LEN(str);
+        pos = i_mm->t->real;
     }
     else if (pos < 0)
     {
@@ -1735,6 +3779,7 @@ mm_cat(VALUE str, const char *ptr, long len)
                 ptr = sptr + poffset;
             memcpy(sptr + i_mm->t->real, ptr, len);
         }
+        mm_i_dirty(i_mm->t, i_mm->t->real, i_mm->t->real + len);
         i_mm->t->real += len;
         mm_unlock(i_mm);
     }
@@ -1807,10 +3852,12 @@ mm_strip_bang(VALUE str)
     {
         memmove(i_mm->t->addr, s, i_mm->t->real);
         ((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
+        mm_i_dirty(i_mm->t, 0, i_mm->t->real + 1);
     }
     else if (t < e)
     {
         ((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
+        mm_i_dirty(i_mm->t, i_mm->t->real, i_mm->t->real + 1);
     }
     else
     {
@@ -1851,6 +3898,7 @@ mm_lstrip_bang(VALUE str)
     {
         memmove(i_mm->t->addr, s, i_mm->t->real);
         ((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
+        mm_i_dirty(i_mm->t, 0, i_mm->t->real + 1);
         mm_unlock(i_mm);
         return str;
     }
@@ -1886,6 +3934,7 @@ mm_rstrip_bang(VALUE str)
     if (t < e)
     {
         ((char *)i_mm->t->addr)[i_mm->t->real] = '\0';
+        mm_i_dirty(i_mm->t, i_mm->t->real, i_mm->t->real + 1);
         mm_unlock(i_mm);
         return str;
     }
@@ -1919,44 +3968,161 @@ mm_strip_bang(VALUE str)
         }                                                                    \
     } while (0);
 
-/*
- * call-seq: <=>(other)
- *
- * comparison : return -1, 0, 1
- */
-static VALUE
-mm_cmp(VALUE a, VALUE b)
+/* bytes of a String or a Mmap argument, a Mmap is not copied */
+static void
+mm_i_needle(VALUE sub, const char **ptr, size_t *len)
 {
-    int result;
+    mm_ipc *i_mm;
 
-    a = mm_str(a, MM_ORIGIN);
-    MmapStr(b);
-    result = rb_str_cmp(a, b);
-    return INT2FIX(result);
+    if (TYPE(sub) == T_DATA && RDATA(sub)->dfree == (RUBY_DATA_FUNC)mm_free)
+    {
+        GetMmap(sub, i_mm, 0);
+        MM_CHECK_WINDOW(i_mm);
+        *ptr = i_mm->t->addr;
+        *len = i_mm->t->real;
+    }
+    else
+    {
+        sub = rb_str_to_str(sub);
+        *ptr = RSTRING_PTR(sub);
+        *len = RSTRING_LEN(sub);
+    }
 }
 
-#if HAVE_RB_STR_CASECMP
-
-/*
- * call-seq: casecmp(other)
- *
- * only with ruby >= 1.7.1
- */
-static VALUE
-mm_casecmp(VALUE a, VALUE b)
+/* ASCII case insensitive comparison of n bytes */
+static int
+mm_i_casecmp(const char *a, const char *b, size_t n)
 {
-    VALUE result;
+    size_t i;
+    int c1, c2;
 
-    a = mm_str(a, MM_ORIGIN);
-    MmapStr(b);
-    result = rb_funcall2(a, rb_intern("casecmp"), 1, &b);
-    return result;
+    for (i = 0; i < n; i++)
+    {
+        c1 = rb_tolower((unsigned char)a[i]);
+        c2 = rb_tolower((unsigned char)b[i]);
+        if (c1 != c2)
+        {
+            return c1 < c2 ? -1 : 1;
+        }
+    }
+    return 0;
 }
 
-#endif
+/* last occurrence of sub in hay */
+static const char *
+mm_i_memrmem(const char *hay, size_t hlen, const char *sub, size_t slen)
+{
+    const char *p;
 
-/*
- * Document-method: ==
+    if (slen == 0)
+    {
+        return hay + hlen;
+    }
+    if (slen > hlen)
+    {
+        return NULL;
+    }
+    hlen -= slen - 1;
+    while ((p = memrchr(hay, sub[0], hlen)))
+    {
+        if (memcmp(p + 1, sub + 1, slen - 1) == 0)
+        {
+            return p;
+        }
+        hlen = p - hay;
+    }
+    return NULL;
+}
+
+/* first ASCII case insensitive occurrence of sub in hay */
+static const char *
+mm_i_memcasemem(const char *hay, size_t hlen, const char *sub, size_t slen)
+{
+    const char *p, *nlo, *nup, *end;
+    int lo, up;
+
+    if (slen == 0)
+    {
+        return hay;
+    }
+    if (slen > hlen)
+    {
+        return NULL;
+    }
+    lo = rb_tolower((unsigned char)sub[0]);
+    up = rb_toupper((unsigned char)sub[0]);
+    end = hay + hlen - slen + 1;
+    /*
+     * the next position of the first byte in each case, memchr() looks
+     * again for one of them only when it was the candidate just tried
+     */
+    nlo = memchr(hay, lo, end - hay);
+    nup = lo != up ? memchr(hay, up, end - hay) : NULL;
+    while (nlo || nup)
+    {
+        p = !nup || (nlo && nlo < nup) ? nlo : nup;
+        if (mm_i_casecmp(p + 1, sub + 1, slen - 1) == 0)
+        {
+            return p;
+        }
+        if (p == nlo)
+        {
+            nlo = memchr(p + 1, lo, end - p - 1);
+        }
+        else
+        {
+            nup = memchr(p + 1, up, end - p - 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * call-seq: <=>(other)
+ *
+ * comparison : return -1, 0, 1
+ */
+static VALUE
+mm_cmp(VALUE a, VALUE b)
+{
+    int result;
+
+    a = mm_str(a, MM_ORIGIN);
+    MmapStr(b);
+    result = rb_str_cmp(a, b);
+    return INT2FIX(result);
+}
+
+#if HAVE_RB_STR_CASECMP
+
+/*
+ * call-seq: casecmp(other)
+ *
+ * ASCII case insensitive comparison : return -1, 0, 1
+ */
+static VALUE
+mm_casecmp(VALUE a, VALUE b)
+{
+    mm_ipc *i_mm;
+    const char *ptr;
+    size_t len;
+    int result;
+
+    GetMmap(a, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    mm_i_needle(b, &ptr, &len);
+    result = mm_i_casecmp(i_mm->t->addr, ptr, len < i_mm->t->real ? len : i_mm->t->real);
+    if (result == 0 && len != i_mm->t->real)
+    {
+        result = i_mm->t->real < len ? -1 : 1;
+    }
+    return INT2FIX(result);
+}
+
+#endif
+
+/*
+ * Document-method: ==
  * Document-method: ===
  *
  * call-seq: ==
@@ -2035,7 +4201,7 @@ mm_size(VALUE a)
 {
     mm_ipc *i_mm;
 
-    GetMmap(a, i_mm, 0);
+    GetMmap(a, i_mm, MM_KEEPGAP);
     return ULONG2NUM(i_mm->t->real);
 }
 
@@ -2049,7 +4215,7 @@ mm_empty(VALUE a)
 {
     mm_ipc *i_mm;
 
-    GetMmap(a, i_mm, 0);
+    GetMmap(a, i_mm, MM_KEEPGAP);
     if (i_mm->t->real == 0)
         return Qtrue;
     return Qfalse;
@@ -2074,8 +4240,10 @@ mm_i_bang(VALUE arg)
     mm_bang *bang_st = (mm_bang *)arg;
     VALUE str, res;
     mm_ipc *i_mm;
+    size_t real;
 
     str = mm_str(bang_st->obj, bang_st->flag);
+    real = RSTRING_LEN(str);
     if (bang_st->flag & MM_PROTECT)
     {
         VALUE tmp[4];
@@ -2090,10 +4258,20 @@ mm_i_bang(VALUE arg)
         res = rb_funcall2(str, bang_st->id, bang_st->argc, bang_st->argv);
         RB_GC_GUARD(res);
     }
+    if ((bang_st->flag & (MM_MODIFY | MM_ORIGIN)) == MM_ORIGIN)
+    {
+        GetMmap(bang_st->obj, i_mm, 0);
+        mm_i_track_match(i_mm, rb_backref_get());
+        return mm_i_detach(i_mm, res);
+    }
     if (res != Qnil)
     {
         GetMmap(bang_st->obj, i_mm, 0);
         i_mm->t->real = RSTRING_LEN(str);
+        if (bang_st->flag & MM_MODIFY)
+        {
+            mm_i_dirty(i_mm->t, 0, real > i_mm->t->real ? real : i_mm->t->real);
+        }
     }
     return res;
 }
@@ -2200,180 +4378,1779 @@ mm_reverse_bang(VALUE a)
     return mm_bang_i(a, MM_MODIFY, rb_intern("reverse!"), 0, 0);
 }
 
-/*
- * call-seq: chop!
- *
- * chop off the last character
- */
+/*
+ * call-seq: chop!
+ *
+ * chop off the last character
+ */
+static VALUE
+mm_chop_bang(VALUE a)
+{
+    return mm_bang_i(a, MM_CHANGE, rb_intern("chop!"), 0, 0);
+}
+
+/*
+ * call-seq: chomp!(rs = $/)
+ *
+ * chop off the  line ending character, specified by <em>rs</em>
+ */
+static VALUE
+mm_chomp_bang(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("chomp!"), argc, argv);
+}
+
+/*
+ * build the lookup table of the bytes selected by the character sets
+ * given to count and delete!, with the syntax of String#count
+ */
+static void
+mm_i_charset(int argc, VALUE *argv, unsigned char *table)
+{
+    unsigned char set[256];
+    const unsigned char *p, *end;
+    unsigned int c, last;
+    int i, j, neg;
+    VALUE str;
+
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    memset(table, 1, 256);
+    for (i = 0; i < argc; i++)
+    {
+        str = rb_str_to_str(argv[i]);
+        p = (const unsigned char *)RSTRING_PTR(str);
+        end = p + RSTRING_LEN(str);
+        neg = RSTRING_LEN(str) > 1 && *p == '^';
+        if (neg)
+        {
+            p++;
+        }
+        memset(set, 0, sizeof(set));
+        while (p < end)
+        {
+            if (*p == '\\' && p + 1 < end)
+            {
+                p++;
+            }
+            c = last = *p++;
+            if (p + 1 < end && *p == '-')
+            {
+                last = p[1];
+                p += 2;
+                if (c > last)
+                {
+                    rb_raise(rb_eArgError, "invalid range \"%c-%c\" in string transliteration", c, last);
+                }
+            }
+            for (; c <= last; c++)
+            {
+                set[c] = 1;
+            }
+        }
+        for (j = 0; j < 256; j++)
+        {
+            table[j] &= set[j] ^ neg;
+        }
+    }
+}
+
+/*
+ * call-seq: delete!(str)
+ *
+ * delete every characters included in <em>str</em>, the map is compacted
+ * in place
+ */
+static VALUE
+mm_delete_bang(int argc, VALUE *argv, VALUE obj)
+{
+    unsigned char table[256];
+    unsigned char *addr;
+    mm_ipc *i_mm;
+    size_t i, j, first, real;
+
+    GetMmap(obj, i_mm, MM_MODIFY);
+    MM_CHECK_WINDOW(i_mm);
+    if (i_mm->t->flag & MM_FIXED)
+    {
+        rb_raise(rb_eTypeError, "try to change the size of a fixed map");
+    }
+    mm_i_charset(argc, argv, table);
+    mm_lock(i_mm, Qtrue);
+    addr = (unsigned char *)i_mm->t->addr;
+    real = i_mm->t->real;
+    for (first = 0; first < real && !table[addr[first]]; first++)
+        ;
+    for (i = j = first; i < real; i++)
+    {
+        addr[j] = addr[i];
+        j += !table[addr[i]];
+    }
+    if (j == real)
+    {
+        mm_unlock(i_mm);
+        return Qnil;
+    }
+    i_mm->t->real = j;
+    mm_i_dirty(i_mm->t, first, real);
+    mm_unlock(i_mm);
+    return obj;
+}
+
+/*
+ * squeeze!(str)
+ *
+ * squeezes sequences of the same characters which is included in <em>str</em>
+ */
+static VALUE
+mm_squeeze_bang(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("squeeze!"), argc, argv);
+}
+
+/*
+ * call-seq: tr!(search, replace)
+ *
+ * translate the character from <em>search</em> to <em>replace</em>
+ */
+static VALUE
+mm_tr_bang(VALUE obj, VALUE a, VALUE b)
+{
+    VALUE tmp[2];
+    tmp[0] = a;
+    tmp[1] = b;
+    return mm_bang_i(obj, MM_MODIFY | MM_PROTECT, rb_intern("tr!"), 2, tmp);
+}
+
+/*
+ * call-seq: tr_s!(search, replace)
+ *
+ * translate the character from <em>search</em> to <em>replace</em>, then
+ * squeeze sequence of the same characters
+ */
+static VALUE
+mm_tr_s_bang(VALUE obj, VALUE a, VALUE b)
+{
+    VALUE tmp[2];
+    tmp[0] = a;
+    tmp[1] = b;
+    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("tr_s!"), 2, tmp);
+}
+
+/*
+ * call-seq: crypt
+ *
+ * crypt with <em>salt</em>
+ */
+static VALUE
+mm_crypt(VALUE a, VALUE b)
+{
+    return mm_bang_i(a, MM_ORIGIN, rb_intern("crypt"), 1, &b);
+}
+
+#define MM_SEARCH_INDEX 0
+#define MM_SEARCH_RINDEX 1
+#define MM_SEARCH_CASE 2
+
+typedef struct
+{
+    VALUE obj, sub;
+    long pos;
+    int kind;
+} mm_search;
+
+static VALUE
+mm_i_search(VALUE arg)
+{
+    mm_search *st = (mm_search *)arg;
+    mm_ipc *i_mm;
+    const char *addr, *ptr, *hit;
+    size_t len, real;
+    long pos = st->pos;
+
+    GetMmap(st->obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    mm_i_needle(st->sub, &ptr, &len);
+    addr = i_mm->t->addr;
+    real = i_mm->t->real;
+    if (pos < 0)
+    {
+        pos += real;
+        if (pos < 0)
+        {
+            return Qnil;
+        }
+    }
+    if (st->kind == MM_SEARCH_RINDEX)
+    {
+        if ((size_t)pos > real)
+        {
+            pos = real;
+        }
+        hit = mm_i_memrmem(addr, real - pos < len ? real : pos + len, ptr, len);
+    }
+    else
+    {
+        if ((size_t)pos > real)
+        {
+            return Qnil;
+        }
+        if (st->kind == MM_SEARCH_CASE)
+        {
+            hit = mm_i_memcasemem(addr + pos, real - pos, ptr, len);
+        }
+        else
+        {
+            hit = len ? memmem(addr + pos, real - pos, ptr, len) : addr + pos;
+        }
+    }
+    return hit ? LONG2NUM(hit - addr) : Qnil;
+}
+
+/* search directly in the map, with the lock held for a shared map */
+static VALUE
+mm_i_search_locked(VALUE obj, VALUE sub, long pos, int kind)
+{
+    mm_ipc *i_mm;
+    mm_search st;
+
+    st.obj = obj;
+    st.sub = sub;
+    st.pos = pos;
+    st.kind = kind;
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->flag & MM_IPC)
+    {
+        mm_lock(i_mm, Qtrue);
+        return rb_ensure(mm_i_search, (VALUE)&st, mm_vunlock, obj);
+    }
+    return mm_i_search((VALUE)&st);
+}
+
+/*
+ * call-seq: index
+ *
+ * return the index of <em>substr</em>
+ */
+static VALUE
+mm_window_index(mm_ipc *i_mm, int argc, VALUE *argv)
+{
+    VALUE sub, initpos;
+    long pos = 0;
+    size_t off, avail, real = i_mm->t->real;
+    char *ptr, *hit;
+
+    if (rb_scan_args(argc, argv, "11", &sub, &initpos) == 2)
+    {
+        pos = NUM2LONG(initpos);
+        if (pos < 0)
+        {
+            pos += real;
+            if (pos < 0)
+            {
+                return Qnil;
+            }
+        }
+    }
+    if (TYPE(sub) != T_STRING)
+    {
+        rb_raise(rb_eTypeError, "only a String can be searched in a windowed map");
+    }
+    if ((size_t)RSTRING_LEN(sub) > i_mm->t->wsize)
+    {
+        rb_raise(rb_eArgError, "substring longer than the window");
+    }
+    if ((size_t)pos > real)
+    {
+        return Qnil;
+    }
+    if (RSTRING_LEN(sub) == 0)
+    {
+        return LONG2NUM(pos);
+    }
+    for (off = pos; off + RSTRING_LEN(sub) <= real; off += avail - RSTRING_LEN(sub) + 1)
+    {
+        ptr = mm_i_window(i_mm->t, off, &avail);
+        hit = memmem(ptr, avail, RSTRING_PTR(sub), RSTRING_LEN(sub));
+        if (hit)
+        {
+            return LONG2NUM(off + (hit - ptr));
+        }
+        if (off + avail >= real)
+        {
+            break;
+        }
+    }
+    return Qnil;
+}
+
+static VALUE
+mm_index(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        return mm_window_index(i_mm, argc, argv);
+    }
+    rb_check_arity(argc, 1, 2);
+    if (RB_TYPE_P(argv[0], T_REGEXP))
+    {
+        return mm_bang_i(obj, MM_ORIGIN, rb_intern("index"), argc, argv);
+    }
+    return mm_i_search_locked(obj, argv[0], argc == 2 ? NUM2LONG(argv[1]) : 0, MM_SEARCH_INDEX);
+}
+
+/*
+ * call-seq: rindex(sibstr, pos = nil)
+ *
+ * return the index of the last occurrence of <em>substr</em>
+ */
+static VALUE
+mm_rindex(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    rb_check_arity(argc, 1, 2);
+    if (RB_TYPE_P(argv[0], T_REGEXP))
+    {
+        return mm_bang_i(obj, MM_ORIGIN, rb_intern("rindex"), argc, argv);
+    }
+    GetMmap(obj, i_mm, 0);
+    return mm_i_search_locked(obj, argv[0], argc == 2 ? NUM2LONG(argv[1]) : (long)i_mm->t->real,
+                              MM_SEARCH_RINDEX);
+}
+
+/*
+ * call-seq: casecmp_index(substr, pos = 0)
+ *
+ * return the index of <em>substr</em>, ignoring the ASCII case
+ */
+static VALUE
+mm_casecmp_index(int argc, VALUE *argv, VALUE obj)
+{
+    rb_check_arity(argc, 1, 2);
+    return mm_i_search_locked(obj, argv[0], argc == 2 ? NUM2LONG(argv[1]) : 0, MM_SEARCH_CASE);
+}
+
+/*
+ * call-seq: include?(other)
+ *
+ * return <em>true</em> if <em>other</em> is found
+ */
+static VALUE
+mm_include(VALUE a, VALUE b)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(a, i_mm, 0);
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        return RTEST(mm_window_index(i_mm, 1, &b)) ? Qtrue : Qfalse;
+    }
+    return RTEST(mm_i_search_locked(a, b, 0, MM_SEARCH_INDEX)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Document-method: []
+ * Document-method: slice
+ *
+ * call-seq: [](args)
+ *
+ * Element reference - with the following syntax:
+ *
+ *   self[nth]
+ *
+ * retrieve the <em>nth</em> character
+ *
+ *   self[start..last]
+ *
+ * return a substring from <em>start</em> to <em>last</em>
+ *
+ *   self[start, length]
+ *
+ * return a substring of <em>lenght</em> characters from <em>start</em>
+ */
+static VALUE
+mm_window_aref(mm_ipc *i_mm, int argc, VALUE *argv)
+{
+    long beg, len, real = i_mm->t->real;
+    VALUE res;
+
+    if (argc == 2)
+    {
+        beg = NUM2LONG(argv[0]);
+        len = NUM2LONG(argv[1]);
+        if (beg < 0)
+        {
+            beg += real;
+        }
+        if (len < 0 || beg < 0 || beg > real)
+        {
+            return Qnil;
+        }
+    }
+    else if (argc == 1 && rb_obj_is_kind_of(argv[0], rb_cInteger))
+    {
+        beg = NUM2LONG(argv[0]);
+        if (beg < 0)
+        {
+            beg += real;
+        }
+        if (beg < 0 || beg >= real)
+        {
+            return Qnil;
+        }
+        len = 1;
+    }
+    else if (argc == 1 && rb_obj_is_kind_of(argv[0], rb_cRange))
+    {
+        if (rb_range_beg_len(argv[0], &beg, &len, real, 0) != Qtrue)
+        {
+            return Qnil;
+        }
+    }
+    else
+    {
+        rb_raise(rb_eTypeError, "only Integer and Range indexes for a windowed map");
+    }
+    if (beg + len > real)
+    {
+        len = real - beg;
+    }
+    res = rb_str_new(0, len);
+    mm_i_window_read(i_mm->t, beg, len, RSTRING_PTR(res));
+    return res;
+}
+
+static VALUE
+mm_aref_m(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        return mm_window_aref(i_mm, argc, argv);
+    }
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("[]"), argc, argv);
+}
+
+typedef struct
+{
+    VALUE map;
+    size_t off, len;
+} mm_slice;
+
+static void
+mm_slice_mark(mm_slice *sl)
+{
+    rb_gc_mark(sl->map);
+}
+
+static VALUE
+mm_i_slice_new(VALUE obj, size_t off, size_t len)
+{
+    mm_slice *sl;
+    VALUE res;
+
+    res = Data_Make_Struct(mm_cSlice, mm_slice, mm_slice_mark, -1, sl);
+    sl->map = obj;
+    sl->off = off;
+    sl->len = len;
+    return res;
+}
+
+/*
+ * call-seq: view(offset, length)
+ *
+ * return a Mmap::Slice for <em>length</em> bytes from <em>offset</em>.
+ * The slice reads the mapped bytes, nothing is copied until
+ * Mmap::Slice#to_s is called
+ */
+static VALUE
+mm_view(VALUE obj, VALUE voff, VALUE vlen)
+{
+    mm_ipc *i_mm;
+    long off = NUM2LONG(voff), len = NUM2LONG(vlen);
+
+    GetMmap(obj, i_mm, 0);
+    if (off < 0)
+    {
+        off += i_mm->t->real;
+    }
+    if (off < 0 || i_mm->t->real < (size_t)off || len < 0)
+    {
+        rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+    }
+    if (i_mm->t->real - off < (size_t)len)
+    {
+        len = i_mm->t->real - off;
+    }
+    return mm_i_slice_new(obj, off, len);
+}
+
+static mm_slice *
+mm_i_slice(VALUE obj, mm_ipc **p_mm)
+{
+    mm_slice *sl;
+    mm_ipc *i_mm;
+
+    Data_Get_Struct(obj, mm_slice, sl);
+    GetMmap(sl->map, i_mm, 0);
+    if (i_mm->t->real < sl->off + sl->len)
+    {
+        rb_raise(rb_eIndexError, "slice beyond the end of the map");
+    }
+    *p_mm = i_mm;
+    return sl;
+}
+
+/*
+ * call-seq: to_str
+ *
+ * return a frozen String which reads the mapped bytes. It must not be
+ * kept after the map is modified, moved or unmapped, use #to_s for that
+ */
+static VALUE
+mm_slice_to_str(VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_slice *sl = mm_i_slice(obj, &i_mm);
+    VALUE res;
+
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        res = rb_str_new(0, sl->len);
+        mm_i_window_read(i_mm->t, sl->off, sl->len, RSTRING_PTR(res));
+    }
+    else
+    {
+        res = rb_str_new_static((char *)i_mm->t->addr + sl->off, sl->len);
+    }
+    return rb_obj_freeze(res);
+}
+
+/*
+ * call-seq: to_s
+ *
+ * return a copy of the bytes of the slice
+ */
+static VALUE
+mm_slice_to_s(VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_slice *sl = mm_i_slice(obj, &i_mm);
+    VALUE res;
+
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        res = rb_str_new(0, sl->len);
+        mm_i_window_read(i_mm->t, sl->off, sl->len, RSTRING_PTR(res));
+        return res;
+    }
+    return rb_str_new((char *)i_mm->t->addr + sl->off, sl->len);
+}
+
+static VALUE
+mm_i_slice_send(VALUE obj, ID id, int argc, VALUE *argv)
+{
+    mm_ipc *i_mm;
+    mm_slice *sl;
+    VALUE str, res;
+
+    str = mm_slice_to_str(obj);
+    sl = mm_i_slice(obj, &i_mm);
+    if (rb_block_given_p())
+    {
+        res = rb_block_call_kw(str, id, argc, argv, mm_i_yield_detach, sl->map,
+                               rb_keyword_given_p());
+    }
+    else
+    {
+        res = rb_funcallv_kw(str, id, argc, argv, rb_keyword_given_p());
+    }
+    if (res == str)
+    {
+        return obj;
+    }
+    mm_i_track_match(i_mm, rb_backref_get());
+    return mm_i_detach(i_mm, res);
+}
+
+/*
+ * call-seq: view_send(name, *args, &block)
+ *
+ * run the String method <em>name</em> on #to_str, the strings in its
+ * result and given to the block are copies of their bytes only
+ */
+static VALUE
+mm_slice_send(int argc, VALUE *argv, VALUE obj)
+{
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    return mm_i_slice_send(obj, rb_to_id(argv[0]), argc - 1, argv + 1);
+}
+
+/*
+ * call-seq: [](start, length), [](range), byteslice(start, length)
+ *
+ * return a copy of the bytes in the range, the rest of the slice is not
+ * read. The other arguments of String#[] are given to #view_send
+ */
+static VALUE
+mm_slice_aref(int argc, VALUE *argv, VALUE obj)
+{
+    mm_ipc *i_mm;
+    mm_slice *sl = mm_i_slice(obj, &i_mm);
+    long beg, len;
+    VALUE res;
+
+    if (argc == 2 && RB_INTEGER_TYPE_P(argv[0]) && RB_INTEGER_TYPE_P(argv[1]))
+    {
+        beg = NUM2LONG(argv[0]);
+        len = NUM2LONG(argv[1]);
+        if (beg < 0)
+        {
+            beg += sl->len;
+        }
+        if (len < 0 || beg < 0 || (size_t)beg > sl->len)
+        {
+            return Qnil;
+        }
+    }
+    else if (argc == 1 && RB_INTEGER_TYPE_P(argv[0]))
+    {
+        beg = NUM2LONG(argv[0]);
+        if (beg < 0)
+        {
+            beg += sl->len;
+        }
+        if (beg < 0 || (size_t)beg >= sl->len)
+        {
+            return Qnil;
+        }
+        len = 1;
+    }
+    else if (argc == 1 && rb_obj_is_kind_of(argv[0], rb_cRange))
+    {
+        if (rb_range_beg_len(argv[0], &beg, &len, sl->len, 0) != Qtrue)
+        {
+            return Qnil;
+        }
+    }
+    else
+    {
+        return mm_i_slice_send(obj, rb_frame_this_func(), argc, argv);
+    }
+    if ((size_t)(beg + len) > sl->len)
+    {
+        len = sl->len - beg;
+    }
+    res = rb_str_new(0, len);
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        mm_i_window_read(i_mm->t, sl->off + beg, len, RSTRING_PTR(res));
+    }
+    else
+    {
+        memcpy(RSTRING_PTR(res), (char *)i_mm->t->addr + sl->off + beg, len);
+    }
+    return res;
+}
+
+/*
+ * Document-method: length
+ * Document-method: size
+ *
+ * return the size of the slice
+ */
+static VALUE
+mm_slice_size(VALUE obj)
+{
+    mm_slice *sl;
+
+    Data_Get_Struct(obj, mm_slice, sl);
+    return SIZET2NUM(sl->len);
+}
+
+/*
+ * call-seq: offset
+ *
+ * return the offset of the slice in the map
+ */
+static VALUE
+mm_slice_offset(VALUE obj)
+{
+    mm_slice *sl;
+
+    Data_Get_Struct(obj, mm_slice, sl);
+    return SIZET2NUM(sl->off);
+}
+
+/*
+ * call-seq: map
+ *
+ * return the Mmap of the slice
+ */
+static VALUE
+mm_slice_map(VALUE obj)
+{
+    mm_slice *sl;
+
+    Data_Get_Struct(obj, mm_slice, sl);
+    return sl->map;
+}
+
+#define MM_LINE_STR 0
+#define MM_LINE_OFFSETS 1
+#define MM_LINE_VIEW 2
+
+static void
+mm_i_yield_line(VALUE obj, int mode, const char *addr, size_t off, size_t len)
+{
+    switch (mode)
+    {
+    case MM_LINE_OFFSETS:
+        rb_yield_values(2, SIZET2NUM(off), SIZET2NUM(len));
+        break;
+    case MM_LINE_VIEW:
+        rb_yield(mm_i_slice_new(obj, off, len));
+        break;
+    default:
+        rb_yield(rb_str_new(addr + off, len));
+        break;
+    }
+}
+
+static VALUE
+mm_i_pass_block(RB_BLOCK_CALL_FUNC_ARGLIST(line, arg))
+{
+    return rb_yield_values2(argc, argv);
+}
+
+typedef struct
+{
+    VALUE obj, vsep;
+    int argc;
+    VALUE *argv;
+    int kw, chomp, mode;
+} mm_lines;
+
+static VALUE
+mm_i_each_line(VALUE arg)
+{
+    mm_lines *st = (mm_lines *)arg;
+    VALUE obj = st->obj;
+    mm_ipc *i_mm;
+    const char *sep, *addr, *p;
+    size_t off, end, next, real;
+    long slen;
+    int chomp = st->chomp, mode = st->mode;
+
+    /* the paragraph mode is left to String#each_line */
+    if (!NIL_P(st->vsep) && RSTRING_LEN(st->vsep) == 0)
+    {
+        if (mode != MM_LINE_STR)
+        {
+            rb_raise(rb_eArgError, "offsets: and view: need a separator");
+        }
+        rb_block_call_kw(mm_str(obj, MM_ORIGIN), rb_intern("each_line"), st->argc, st->argv,
+                         mm_i_yield_detach, obj, st->kw);
+        return obj;
+    }
+    GetMmap(obj, i_mm, 0);
+    if (NIL_P(st->vsep))
+    {
+        mm_i_yield_line(obj, mode, i_mm->t->addr, 0, i_mm->t->real);
+        return obj;
+    }
+    sep = RSTRING_PTR(st->vsep);
+    slen = RSTRING_LEN(st->vsep);
+    for (off = 0;; off = next)
+    {
+        /* the block can modify the map, look again at it for each line */
+        GetMmap(obj, i_mm, 0);
+        addr = i_mm->t->addr;
+        real = i_mm->t->real;
+        if (off >= real)
+        {
+            break;
+        }
+        if (slen == 1)
+        {
+            p = memchr(addr + off, sep[0], real - off);
+        }
+        else
+        {
+            p = memmem(addr + off, real - off, sep, slen);
+        }
+        if (p)
+        {
+            next = p - addr + slen;
+            end = chomp ? (size_t)(p - addr) : next;
+            if (chomp && slen == 1 && sep[0] == '\n' && end > off && addr[end - 1] == '\r')
+            {
+                end--;
+            }
+        }
+        else
+        {
+            end = next = real;
+        }
+        mm_i_yield_line(obj, mode, addr, off, end - off);
+    }
+    return obj;
+}
+
+/*
+ * Document-method: each_line
+ *
+ * call-seq:
+ *    each_line(rs = $/, chomp: false, offsets: false, view: false) { |line| ... }
+ *
+ * iterate on each line, the separator is searched directly in the map
+ * with memchr() or memmem(). By default each line is yielded as a new
+ * String; with <em>offsets</em> the offset and the length of the line
+ * are yielded instead, with <em>view</em> a Mmap::Slice. Without a
+ * block an Enumerator is returned
+ */
+static VALUE
+mm_each_line(int argc, VALUE *argv, VALUE obj)
+{
+    static ID ids[3];
+    VALUE vsep, opts, vals[3] = {Qundef, Qundef, Qundef};
+    mm_ipc *i_mm;
+    mm_lines st;
+    int n, chomp, mode = MM_LINE_STR;
+
+    RETURN_ENUMERATOR_KW(obj, argc, argv, rb_keyword_given_p());
+    n = rb_scan_args(argc, argv, "01:", &vsep, &opts);
+    if (!ids[0])
+    {
+        ids[0] = rb_intern("chomp");
+        ids[1] = rb_intern("offsets");
+        ids[2] = rb_intern("view");
+    }
+    if (!NIL_P(opts))
+    {
+        rb_get_kwargs(opts, ids, 0, 3, vals);
+    }
+    chomp = vals[0] != Qundef && RTEST(vals[0]);
+    if (vals[1] != Qundef && RTEST(vals[1]))
+    {
+        mode = MM_LINE_OFFSETS;
+    }
+    else if (vals[2] != Qundef && RTEST(vals[2]))
+    {
+        mode = MM_LINE_VIEW;
+    }
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        rb_block_call_kw(obj, rb_intern("each_window_line"), argc, argv,
+                         mm_i_pass_block, Qnil, rb_keyword_given_p());
+        return obj;
+    }
+    if (n == 0)
+    {
+        vsep = rb_rs;
+    }
+    if (!NIL_P(vsep))
+    {
+        StringValue(vsep);
+    }
+    st.obj = obj;
+    st.vsep = vsep;
+    st.argc = argc;
+    st.argv = argv;
+    st.kw = rb_keyword_given_p();
+    st.chomp = chomp;
+    st.mode = mode;
+    /* the other processes do not modify the map meanwhile */
+    if (i_mm->t->flag & MM_IPC)
+    {
+        mm_lock(i_mm, Qtrue);
+        return rb_ensure(mm_i_each_line, (VALUE)&st, mm_vunlock, obj);
+    }
+    return mm_i_each_line((VALUE)&st);
+}
+
+static VALUE
+mm_i_size_enum(VALUE obj, VALUE args, VALUE eobj)
+{
+    return mm_size(obj);
+}
+
+static VALUE
+mm_i_each_byte(VALUE obj)
+{
+    mm_ipc *i_mm;
+    size_t i;
+
+    for (i = 0;; i++)
+    {
+        /* the block can modify the map */
+        GetMmap(obj, i_mm, 0);
+        if (i >= i_mm->t->real)
+        {
+            break;
+        }
+        rb_yield(INT2FIX(((unsigned char *)i_mm->t->addr)[i]));
+    }
+    return obj;
+}
+
+/*
+ * Document-method: each_byte
+ *
+ * call-seq:
+ *    each_byte { |byte| ... }
+ *    each { |byte| ... }
+ *
+ * iterate on each byte, read directly in the map
+ */
+static VALUE
+mm_each_byte(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    RETURN_SIZED_ENUMERATOR(obj, 0, 0, mm_i_size_enum);
+    GetMmap(obj, i_mm, 0);
+    if (i_mm->t->flag & MM_WINDOW)
+    {
+        rb_block_call(obj, rb_intern("each_window_byte"), 0, NULL, mm_i_pass_block, Qnil);
+        return obj;
+    }
+    if (i_mm->t->flag & MM_IPC)
+    {
+        mm_lock(i_mm, Qtrue);
+        return rb_ensure(mm_i_each_byte, obj, mm_vunlock, obj);
+    }
+    return mm_i_each_byte(obj);
+}
+
+static VALUE
+mm_i_slice_enum(VALUE obj, VALUE args, VALUE eobj)
+{
+    mm_ipc *i_mm;
+    long n = NUM2LONG(RARRAY_AREF(args, 0));
+
+    GetMmap(obj, i_mm, 0);
+    if (n <= 0)
+    {
+        rb_raise(rb_eArgError, "invalid slice size %ld", n);
+    }
+    return SIZET2NUM((i_mm->t->real + n - 1) / n);
+}
+
+/*
+ * call-seq:
+ *    each_byte_slice(n) { |slice| ... }
+ *
+ * iterate on consecutive blocks of <em>n</em> bytes, yielded as
+ * Mmap::Slice. The last block can be shorter
+ */
+static VALUE
+mm_each_byte_slice(VALUE obj, VALUE vn)
+{
+    mm_ipc *i_mm;
+    long n = NUM2LONG(vn);
+    size_t off, len;
+
+    if (n <= 0)
+    {
+        rb_raise(rb_eArgError, "invalid slice size %ld", n);
+    }
+    RETURN_SIZED_ENUMERATOR(obj, 1, &vn, mm_i_slice_enum);
+    for (off = 0;; off += len)
+    {
+        GetMmap(obj, i_mm, 0);
+        if (off >= i_mm->t->real)
+        {
+            break;
+        }
+        len = i_mm->t->real - off;
+        if ((size_t)n < len)
+        {
+            len = n;
+        }
+        rb_yield(mm_i_slice_new(obj, off, len));
+    }
+    return obj;
+}
+
+/*
+ * call-seq: editing
+ *
+ * return the editing mode, <em>:direct</em> or <em>:gap</em>
+ */
+static VALUE
+mm_editing(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, MM_KEEPGAP);
+    return ID2SYM(rb_intern((i_mm->t->flag & MM_GAP) ? "gap" : "direct"));
+}
+
+/*
+ * call-seq: editing = mode
+ *
+ * with <em>:direct</em>, the default, each insert or delete moves all
+ * the bytes after it. With <em>:gap</em> the map keeps a gap at the
+ * position of the last edit, an edit next to it only moves the bytes
+ * in between. The methods which need the whole map close the gap
+ * first, as does #compact!
+ */
+static VALUE
+mm_editing_set(VALUE obj, VALUE mode)
+{
+    mm_ipc *i_mm;
+    int flag = mm_i_editing(mode);
+
+    GetMmap(obj, i_mm, MM_MODIFY | (flag ? MM_KEEPGAP : 0));
+    MM_CHECK_WINDOW(i_mm);
+    if (flag && (i_mm->t->flag & MM_IPC))
+    {
+        rb_raise(rb_eTypeError, "gap editing for a shared map");
+    }
+    i_mm->t->flag = (i_mm->t->flag & ~MM_GAP) | flag;
+    return mode;
+}
+
+/*
+ * call-seq: compact!
+ *
+ * close the gap left by editing: :gap, the file then holds the final
+ * content of the map. Return <em>nil</em> if there was no gap
+ */
+static VALUE
+mm_compact_bang(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, MM_MODIFY | MM_KEEPGAP);
+    if (!i_mm->t->gapsize)
+    {
+        return Qnil;
+    }
+    mm_i_gap_close(i_mm->t);
+    return obj;
+}
+
+/*
+ * call-seq: windowed?
+ *
+ * return <em>true</em> if the file is mapped through sliding windows
+ */
+static VALUE
+mm_windowed(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    return (i_mm->t->flag & MM_WINDOW) ? Qtrue : Qfalse;
+}
+
+static VALUE
+mm_window_size(VALUE obj)
+{
+    mm_ipc *i_mm;
+
+    GetMmap(obj, i_mm, 0);
+    return ULONG2NUM(i_mm->t->wsize);
+}
+
+/*
+ * call-seq: sum(bits = 16)
+ *
+ * return a checksum
+ */
+static VALUE
+mm_sum(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("sum"), argc, argv);
+}
+
+/*
+ * call-seq: split(sep, limit = 0)
+ *
+ * splits into a list of strings and return this array
+ */
+static VALUE
+mm_split(int argc, VALUE *argv, VALUE obj)
+{
+    return mm_bang_i(obj, MM_ORIGIN, rb_intern("split"), argc, argv);
+}
+
+/*
+ * call-seq: scan(pattern, &block)
+ *
+ * return an array of all occurence matched by <em>pattern</em>
+ */
+static VALUE
+mm_scan(VALUE obj, VALUE pat)
+{
+    mm_ipc *i_mm;
+
+    if (!rb_block_given_p())
+    {
+        return mm_bang_i(obj, MM_ORIGIN, rb_intern("scan"), 1, &pat);
+    }
+    rb_block_call(mm_str(obj, MM_ORIGIN), rb_intern("scan"), 1, &pat, mm_i_yield_detach, obj);
+    GetMmap(obj, i_mm, 0);
+    mm_i_track_match(i_mm, rb_backref_get());
+    return obj;
+}
+
+typedef struct
+{
+    mm_ipc *i_mm;
+    const unsigned char *table;
+    size_t (*hist)[256];
+    size_t count;
+} mm_tally;
+
+static VALUE
+mm_i_count(VALUE arg)
+{
+    mm_tally *st = (mm_tally *)arg;
+    const unsigned char *addr = (const unsigned char *)st->i_mm->t->addr;
+    size_t i, real = st->i_mm->t->real;
+
+    for (i = 0; i < real; i++)
+    {
+        st->count += st->table[addr[i]];
+    }
+    return Qnil;
+}
+
+/* the other processes do not modify the map during the scan */
+static void
+mm_i_tally(VALUE obj, VALUE (*scan)(VALUE), mm_tally *st)
+{
+    if (st->i_mm->t->flag & MM_IPC)
+    {
+        mm_lock(st->i_mm, Qtrue);
+        rb_ensure(scan, (VALUE)st, mm_vunlock, obj);
+    }
+    else
+    {
+        scan((VALUE)st);
+    }
+}
+
+/*
+ * call-seq: count(o1, *args)
+ *
+ * each parameter defines a set of character to count
+ */
+static VALUE
+mm_count(int argc, VALUE *argv, VALUE obj)
+{
+    unsigned char table[256];
+    mm_tally st;
+
+    MEMZERO(&st, mm_tally, 1);
+    GetMmap(obj, st.i_mm, 0);
+    MM_CHECK_WINDOW(st.i_mm);
+    mm_i_charset(argc, argv, table);
+    st.table = table;
+    mm_i_tally(obj, mm_i_count, &st);
+    return SIZET2NUM(st.count);
+}
+
+static VALUE
+mm_i_histogram(VALUE arg)
+{
+    mm_tally *st = (mm_tally *)arg;
+    const unsigned char *addr = (const unsigned char *)st->i_mm->t->addr;
+    size_t i, real = st->i_mm->t->real, (*hist)[256] = st->hist;
+
+    /* four tables so that consecutive equal bytes do not serialize */
+    for (i = 0; i + 4 <= real; i += 4)
+    {
+        hist[0][addr[i]]++;
+        hist[1][addr[i + 1]]++;
+        hist[2][addr[i + 2]]++;
+        hist[3][addr[i + 3]]++;
+    }
+    for (; i < real; i++)
+    {
+        hist[0][addr[i]]++;
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq: byte_histogram
+ *
+ * return an Array with the number of occurrences of each byte value
+ */
+static VALUE
+mm_byte_histogram(VALUE obj)
+{
+    size_t i, hist[4][256];
+    mm_tally st;
+    VALUE res;
+
+    MEMZERO(&st, mm_tally, 1);
+    GetMmap(obj, st.i_mm, 0);
+    MM_CHECK_WINDOW(st.i_mm);
+    memset(hist, 0, sizeof(hist));
+    st.hist = hist;
+    mm_i_tally(obj, mm_i_histogram, &st);
+    res = rb_ary_new_capa(256);
+    for (i = 0; i < 256; i++)
+    {
+        rb_ary_push(res, SIZET2NUM(hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i]));
+    }
+    return res;
+}
+
+typedef struct
+{
+    char *addr;
+    size_t len;
+} mm_warm;
+
+typedef struct
+{
+    mm_ipc *i_mm;
+    mm_warm *parts;
+    pthread_t *th;
+    int *started;
+    size_t count, chunk;
+    int locktmp;
+} mm_warm_all;
+
+#define MM_WARM_MAX 64
+
+static void *
+mm_i_warmup(void *arg)
+{
+    mm_warm *w = (mm_warm *)arg;
+
+    mm_i_touch(w->addr, w->len);
+    return NULL;
+}
+
+static void *
+mm_i_warmup_all(void *arg)
+{
+    mm_warm_all *all = (mm_warm_all *)arg;
+    size_t i, n = all->count;
+    pthread_t *th = all->th;
+    int *started = all->started;
+
+    for (i = 1; i < n; i++)
+    {
+        started[i] = pthread_create(&th[i], NULL, mm_i_warmup, &all->parts[i]) == 0;
+        if (!started[i])
+        {
+            mm_i_warmup(&all->parts[i]);
+        }
+    }
+    mm_i_warmup(&all->parts[0]);
+    for (i = 1; i < n; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(th[i], NULL);
+        }
+    }
+    return NULL;
+}
+
 static VALUE
-mm_chop_bang(VALUE a)
+mm_i_warmup_run(VALUE arg)
 {
-    return mm_bang_i(a, MM_CHANGE, rb_intern("chop!"), 0, 0);
+    mm_warm_all *all = (mm_warm_all *)arg;
+    mm_mmap *t = all->i_mm->t;
+    size_t i;
+
+    all->parts = ALLOC_N(mm_warm, all->count);
+    all->th = ALLOC_N(pthread_t, all->count);
+    all->started = ALLOC_N(int, all->count);
+    for (i = 0; i < all->count; i++)
+    {
+        size_t beg = i * all->chunk;
+
+        all->parts[i].addr = MM_BASE(t) + beg;
+        all->parts[i].len = beg < MM_SPAN(t) ? MM_SPAN(t) - beg : 0;
+        if (all->parts[i].len > all->chunk)
+        {
+            all->parts[i].len = all->chunk;
+        }
+    }
+    /* the other threads can run but not move or unmap the map */
+    t->locktmp++;
+    all->locktmp = 1;
+    rb_thread_call_without_gvl(mm_i_warmup_all, all, NULL, NULL);
+    all->locktmp = 0;
+    t->locktmp--;
+    return Qnil;
 }
 
-/*
- * call-seq: chomp!(rs = $/)
- *
- * chop off the  line ending character, specified by <em>rs</em>
- */
 static VALUE
-mm_chomp_bang(int argc, VALUE *argv, VALUE obj)
+mm_i_warmup_free(VALUE arg)
 {
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("chomp!"), argc, argv);
+    mm_warm_all *all = (mm_warm_all *)arg;
+
+    if (all->locktmp)
+    {
+        all->i_mm->t->locktmp--;
+    }
+    xfree(all->parts);
+    xfree(all->th);
+    xfree(all->started);
+    return Qnil;
 }
 
 /*
- * call-seq: delete!(str)
+ * call-seq: warmup(threads: n)
  *
- * delete every characters included in <em>str</em>
+ * fault in every page of the map from <em>n</em> native threads, the
+ * GVL is released during the operation. By default one thread per
+ * online CPU is used, at most 64. In the meantime the other threads
+ * which modify, move or unmap the map get a RuntimeError
  */
 static VALUE
-mm_delete_bang(int argc, VALUE *argv, VALUE obj)
+mm_warmup(int argc, VALUE *argv, VALUE obj)
 {
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("delete!"), argc, argv);
+    mm_ipc *i_mm;
+    VALUE opts, nth = Qnil;
+    ID id_threads = rb_intern("threads");
+    mm_warm_all all;
+    size_t n, pages;
+    long cpus;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
+    {
+        rb_get_kwargs(opts, &id_threads, 0, 1, &nth);
+        if (nth == Qundef)
+        {
+            nth = Qnil;
+        }
+    }
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    if (NIL_P(nth))
+    {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (size_t)cpus : 1;
+    }
+    else
+    {
+        long v = NUM2LONG(nth);
+        if (v <= 0)
+        {
+            rb_raise(rb_eArgError, "Invalid number of threads %ld", v);
+        }
+        n = v;
+    }
+    pages = (MM_SPAN(i_mm->t) + mm_pagesize - 1) / mm_pagesize;
+    if (n > MM_WARM_MAX)
+    {
+        n = MM_WARM_MAX;
+    }
+    if (n > pages)
+    {
+        n = pages ? pages : 1;
+    }
+    MEMZERO(&all, mm_warm_all, 1);
+    all.i_mm = i_mm;
+    all.count = n;
+    all.chunk = ((pages + n - 1) / n) * mm_pagesize;
+    rb_ensure(mm_i_warmup_run, (VALUE)&all, mm_i_warmup_free, (VALUE)&all);
+    return obj;
 }
 
 /*
- * squeeze!(str)
- *
- * squeezes sequences of the same characters which is included in <em>str</em>
+ * shared by the native thread and the Mmap::Prefetch handle, the last
+ * one to drop its reference frees it. The thread only issues system
+ * calls on the range, an unmap in the meantime can not make it fault
  */
-static VALUE
-mm_squeeze_bang(int argc, VALUE *argv, VALUE obj)
+typedef struct
 {
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("squeeze!"), argc, argv);
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *addr;
+    size_t len;
+    int fd;
+    off_t foff;
+    int refs, done, error;
+} mm_prefetch;
+
+static void
+mm_i_prefetch_release(mm_prefetch *p)
+{
+    int refs;
+
+    pthread_mutex_lock(&p->mutex);
+    refs = --p->refs;
+    pthread_mutex_unlock(&p->mutex);
+    if (!refs)
+    {
+        pthread_mutex_destroy(&p->mutex);
+        pthread_cond_destroy(&p->cond);
+        free(p);
+    }
 }
 
-/*
- * call-seq: tr!(search, replace)
- *
- * translate the character from <em>search</em> to <em>replace</em>
- */
-static VALUE
-mm_tr_bang(VALUE obj, VALUE a, VALUE b)
+static void *
+mm_i_prefetch(void *arg)
 {
-    VALUE tmp[2];
-    tmp[0] = a;
-    tmp[1] = b;
-    return mm_bang_i(obj, MM_MODIFY | MM_PROTECT, rb_intern("tr!"), 2, tmp);
+    mm_prefetch *p = (mm_prefetch *)arg;
+    int ret = -1, err = 0;
+
+#ifdef HAVE_READAHEAD
+    if (p->fd != -1)
+    {
+        readahead(p->fd, p->foff, p->len);
+    }
+#endif
+    if (p->addr)
+    {
+#ifdef MADV_POPULATE_READ
+        ret = madvise(p->addr, p->len, MADV_POPULATE_READ);
+#endif
+        if (ret == -1 && madvise(p->addr, p->len, MADV_WILLNEED) == -1)
+        {
+            err = errno;
+        }
+    }
+    pthread_mutex_lock(&p->mutex);
+    p->done = 1;
+    p->error = err;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    mm_i_prefetch_release(p);
+    return NULL;
 }
 
 /*
- * call-seq: tr_s!(search, replace)
+ * call-seq: prefetch(offset = 0, length = size - offset)
  *
- * translate the character from <em>search</em> to <em>replace</em>, then
- * squeeze sequence of the same characters
+ * start to read the range in memory from a native thread and return
+ * at once a Mmap::Prefetch, which can be used to wait for the end of
+ * the operation. The file is read with readahead() and the pages are
+ * then mapped with MADV_POPULATE_READ, or MADV_WILLNEED on older
+ * systems. For a windowed map only the readahead is done
  */
 static VALUE
-mm_tr_s_bang(VALUE obj, VALUE a, VALUE b)
+mm_prefetch_m(int argc, VALUE *argv, VALUE obj)
 {
-    VALUE tmp[2];
-    tmp[0] = a;
-    tmp[1] = b;
-    return mm_bang_i(obj, MM_CHANGE | MM_PROTECT, rb_intern("tr_s!"), 2, tmp);
+    mm_ipc *i_mm;
+    mm_prefetch *p;
+    VALUE voff, vlen, res;
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t beg;
+    long off, len;
+    int err;
+
+    rb_scan_args(argc, argv, "02", &voff, &vlen);
+    GetMmap(obj, i_mm, 0);
+    off = NIL_P(voff) ? 0 : NUM2LONG(voff);
+    len = NIL_P(vlen) ? (long)i_mm->t->len - off : NUM2LONG(vlen);
+    if (off < 0 || i_mm->t->len < (size_t)off || len < 0)
+    {
+        rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+    }
+    if (i_mm->t->len - off < (size_t)len)
+    {
+        len = i_mm->t->len - off;
+    }
+    if ((p = malloc(sizeof(mm_prefetch))) == NULL)
+    {
+        rb_memerror();
+    }
+    MEMZERO(p, mm_prefetch, 1);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->refs = 2;
+    p->fd = i_mm->t->path == (char *)-1 ? -1 : i_mm->t->fd;
+    p->foff = i_mm->t->offset + off;
+    p->len = len;
+    if (i_mm->t->addr)
+    {
+        beg = MM_PAGE_FLOOR(off + i_mm->t->delta);
+        p->addr = MM_BASE(i_mm->t) + beg;
+        p->len = off + i_mm->t->delta + len - beg;
+    }
+    res = Data_Wrap_Struct(mm_cPrefetch, 0, mm_i_prefetch_release, p);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = len ? pthread_create(&thread, &attr, mm_i_prefetch, p) : 0;
+    pthread_attr_destroy(&attr);
+    if (!len || err)
+    {
+        p->done = 1;
+        p->refs--;
+        if (err)
+        {
+            errno = err;
+            rb_sys_fail("pthread_create()");
+        }
+    }
+    return res;
 }
 
-/*
- * call-seq: crypt
- *
- * crypt with <em>salt</em>
- */
-static VALUE
-mm_crypt(VALUE a, VALUE b)
+static void *
+mm_i_prefetch_wait(void *arg)
 {
-    return mm_bang_i(a, MM_ORIGIN, rb_intern("crypt"), 1, &b);
+    mm_prefetch *p = (mm_prefetch *)arg;
+
+    pthread_mutex_lock(&p->mutex);
+    while (!p->done)
+    {
+        pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
 }
 
 /*
- * call-seq: include?(other)
+ * call-seq: wait
  *
- * return <em>true</em> if <em>other</em> is found
+ * wait, with the GVL released, until the range is in memory
  */
 static VALUE
-mm_include(VALUE a, VALUE b)
+mm_prefetch_wait(VALUE obj)
 {
-    return mm_bang_i(a, MM_ORIGIN, rb_intern("include?"), 1, &b);
+    mm_prefetch *p;
+
+    Data_Get_Struct(obj, mm_prefetch, p);
+    rb_thread_call_without_gvl(mm_i_prefetch_wait, p, NULL, NULL);
+    if (p->error)
+    {
+        rb_syserr_fail(p->error, "prefetch");
+    }
+    return obj;
 }
 
 /*
- * call-seq: index
+ * call-seq: done?
  *
- * return the index of <em>substr</em>
+ * return <em>true</em> once the range is in memory
  */
 static VALUE
-mm_index(int argc, VALUE *argv, VALUE obj)
+mm_prefetch_done(VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("index"), argc, argv);
+    mm_prefetch *p;
+    int done;
+
+    Data_Get_Struct(obj, mm_prefetch, p);
+    pthread_mutex_lock(&p->mutex);
+    done = p->done;
+    pthread_mutex_unlock(&p->mutex);
+    return done ? Qtrue : Qfalse;
 }
 
-/*
- * call-seq: rindex(sibstr, pos = nil)
- *
- * return the index of the last occurrence of <em>substr</em>
- */
 static VALUE
-mm_rindex(int argc, VALUE *argv, VALUE obj)
+mm_i_smaps(mm_mmap *t)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("rindex"), argc, argv);
+    FILE *f;
+    char line[256], key[64];
+    unsigned long beg, end, val;
+    uintptr_t lo = (uintptr_t)MM_BASE(t), hi = lo + MM_SPAN(t);
+    int inside = 0, n;
+    VALUE res = rb_hash_new();
+
+    if ((f = fopen("/proc/self/smaps", "r")) == NULL)
+    {
+        rb_sys_fail("/proc/self/smaps");
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        n = 0;
+        if (sscanf(line, "%lx-%lx %n", &beg, &end, &n) == 2 && n)
+        {
+            inside = beg < hi && end > lo;
+        }
+        else if (inside && sscanf(line, "%63[^:]: %lu kB%n", key, &val, &n) == 2 && n)
+        {
+            VALUE k = rb_str_new2(key), old = rb_hash_aref(res, k);
+
+            val *= 1024;
+            if (!NIL_P(old))
+            {
+                val += NUM2ULONG(old);
+            }
+            rb_hash_aset(res, k, ULONG2NUM(val));
+        }
+    }
+    fclose(f);
+    return res;
 }
 
 /*
- * Document-method: []
- * Document-method: slice
- *
- * call-seq: [](args)
- *
- * Element reference - with the following syntax:
- *
- *   self[nth]
- *
- * retrieve the <em>nth</em> character
- *
- *   self[start..last]
- *
- * return a substring from <em>start</em> to <em>last</em>
- *
- *   self[start, length]
+ * call-seq: hugepage_bytes
  *
- * return a substring of <em>lenght</em> characters from <em>start</em>
+ * return the number of bytes of the map currently backed by huge pages
  */
 static VALUE
-mm_aref_m(int argc, VALUE *argv, VALUE obj)
+mm_hugepage_bytes(VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("[]"), argc, argv);
+    static const char *keys[] = {"AnonHugePages", "ShmemPmdMapped", "FilePmdMapped",
+                                 "Shared_Hugetlb", "Private_Hugetlb"};
+    mm_ipc *i_mm;
+    VALUE stats, val;
+    unsigned long res = 0;
+    size_t i;
+
+    GetMmap(obj, i_mm, 0);
+    stats = mm_i_smaps(i_mm->t);
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        val = rb_hash_aref(stats, rb_str_new2(keys[i]));
+        if (!NIL_P(val))
+        {
+            res += NUM2ULONG(val);
+        }
+    }
+    return ULONG2NUM(res);
 }
 
 /*
- * call-seq: sum(bits = 16)
+ * call-seq: memory_stats
  *
- * return a checksum
+ * return a Hash with the sizes, in bytes, reported by /proc/self/smaps
+ * for the map: <em>:size</em>, <em>:rss</em>, <em>:pss</em>,
+ * <em>:shared_clean</em>, <em>:shared_dirty</em>,
+ * <em>:private_clean</em>, <em>:private_dirty</em>,
+ * <em>:referenced</em>, <em>:anonymous</em>, <em>:swap</em>,
+ * <em>:anon_huge_pages</em> and <em>:locked</em>
  */
 static VALUE
-mm_sum(int argc, VALUE *argv, VALUE obj)
+mm_memory_stats(VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("sum"), argc, argv);
+    static const char *keys[][2] = {
+        {"Size", "size"},
+        {"Rss", "rss"},
+        {"Pss", "pss"},
+        {"Shared_Clean", "shared_clean"},
+        {"Shared_Dirty", "shared_dirty"},
+        {"Private_Clean", "private_clean"},
+        {"Private_Dirty", "private_dirty"},
+        {"Referenced", "referenced"},
+        {"Anonymous", "anonymous"},
+        {"Swap", "swap"},
+        {"AnonHugePages", "anon_huge_pages"},
+        {"Locked", "locked"},
+    };
+    mm_ipc *i_mm;
+    VALUE stats, val, res;
+    size_t i;
+
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    stats = mm_i_smaps(i_mm->t);
+    res = rb_hash_new();
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        val = rb_hash_aref(stats, rb_str_new2(keys[i][0]));
+        rb_hash_aset(res, ID2SYM(rb_intern(keys[i][1])), NIL_P(val) ? INT2FIX(0) : val);
+    }
+    return res;
 }
 
 /*
- * call-seq: split(sep, limit = 0)
+ * call-seq: residency(offset = 0, length = size - offset, bitmap: false)
  *
- * splits into a list of strings and return this array
+ * return the number of bytes of the range currently in memory, as
+ * reported by mincore(). With <em>bitmap</em> return instead a String
+ * with one bit per page of the range, least significant bit first, set
+ * when the page is resident
  */
 static VALUE
-mm_split(int argc, VALUE *argv, VALUE obj)
+mm_residency(int argc, VALUE *argv, VALUE obj)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("split"), argc, argv);
+    mm_ipc *i_mm;
+    VALUE voff, vlen, opts, bitmap = Qfalse, vec, res;
+    ID id_bitmap = rb_intern("bitmap");
+    size_t beg, end, base, pages, i, bytes, lo, hi;
+    unsigned char *v;
+    char *bits;
+    long off, len;
+
+    rb_scan_args(argc, argv, "02:", &voff, &vlen, &opts);
+    if (!NIL_P(opts))
+    {
+        rb_get_kwargs(opts, &id_bitmap, 0, 1, &bitmap);
+    }
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    off = NIL_P(voff) ? 0 : NUM2LONG(voff);
+    len = NIL_P(vlen) ? (long)i_mm->t->len - off : NUM2LONG(vlen);
+    if (off < 0 || i_mm->t->len < (size_t)off || len < 0)
+    {
+        rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+    }
+    if (i_mm->t->len - off < (size_t)len)
+    {
+        len = i_mm->t->len - off;
+    }
+    beg = off + i_mm->t->delta;
+    end = beg + len;
+    base = MM_PAGE_FLOOR(beg);
+    pages = (MM_PAGE_CEIL(end) - base) / mm_pagesize;
+    vec = rb_str_new(0, pages);
+    v = (unsigned char *)RSTRING_PTR(vec);
+    if (pages && mincore(MM_BASE(i_mm->t) + base, end - base, (void *)v) == -1)
+    {
+        rb_sys_fail("mincore()");
+    }
+    if (RTEST(bitmap) && bitmap != Qundef)
+    {
+        res = rb_str_new(0, (pages + 7) / 8);
+        bits = RSTRING_PTR(res);
+        MEMZERO(bits, char, RSTRING_LEN(res));
+        for (i = 0; i < pages; i++)
+        {
+            if (v[i] & 1)
+            {
+                bits[i / 8] |= 1 << (i % 8);
+            }
+        }
+        return res;
+    }
+    for (bytes = 0, i = 0; i < pages; i++)
+    {
+        if (v[i] & 1)
+        {
+            lo = base + i * mm_pagesize;
+            hi = lo + mm_pagesize;
+            bytes += (hi < end ? hi : end) - (lo > beg ? lo : beg);
+        }
+    }
+    RB_GC_GUARD(vec);
+    return SIZET2NUM(bytes);
 }
 
-/*
- * call-seq: count(o1, *args)
- *
- * each parameter defines a set of character to count
- */
-static VALUE
-mm_count(int argc, VALUE *argv, VALUE obj)
+static size_t
+mm_i_hugepagesize(void)
 {
-    return mm_bang_i(obj, MM_ORIGIN, rb_intern("count"), argc, argv);
+    FILE *f;
+    char line[128];
+    unsigned long kb;
+    size_t res = 2 << 20;
+
+    if ((f = fopen("/proc/meminfo", "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), f))
+        {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+            {
+                res = kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return res;
 }
 
 /*
@@ -2414,33 +6191,83 @@ mm_munlockall(VALUE obj)
     return Qnil;
 }
 
+/*
+ * page aligned [beg, end) from the base of the map for the optional
+ * offset: and length: of mlock/munlock, return 1 for the whole map
+ */
+static int
+mm_i_lock_range(mm_ipc *i_mm, VALUE *range, size_t *beg, size_t *end)
+{
+    long off, len;
+
+    if (range[0] == Qundef && range[1] == Qundef)
+    {
+        *beg = 0;
+        *end = MM_SPAN(i_mm->t);
+        return 1;
+    }
+    off = range[0] == Qundef ? 0 : NUM2LONG(range[0]);
+    len = range[1] == Qundef ? (long)i_mm->t->len - off : NUM2LONG(range[1]);
+    if (off < 0 || i_mm->t->len < (size_t)off || len < 0)
+    {
+        rb_raise(rb_eIndexError, "invalid range %ld, %ld", off, len);
+    }
+    if (i_mm->t->len - off < (size_t)len)
+    {
+        len = i_mm->t->len - off;
+    }
+    *beg = MM_PAGE_FLOOR(off + i_mm->t->delta);
+    *end = off + i_mm->t->delta + len;
+    return 0;
+}
+
 /*
  * Document-method: lock
  * Document-method: mlock
  *
- * call-seq: mlock
+ * call-seq: mlock(offset: 0, length: size - offset, on_fault: false)
  *
- * disable paging
+ * disable paging, for the whole map or only the pages of the range.
+ * With <em>on_fault</em> the pages are only locked once they are
+ * touched (mlock2() with MLOCK_ONFAULT). When the whole map is locked,
+ * the pages added by a later expansion are locked the same way
  */
 static VALUE
-mm_mlock(VALUE obj)
+mm_mlock(int argc, VALUE *argv, VALUE obj)
 {
     mm_ipc *i_mm;
+    VALUE opts, vals[3] = {Qundef, Qundef, Qundef};
+    ID ids[3];
+    size_t beg, end;
+    int all, flag = 0;
 
-    Data_Get_Struct(obj, mm_ipc, i_mm);
-    if (i_mm->t->flag & MM_LOCK)
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
     {
-        return obj;
+        ids[0] = rb_intern("offset");
+        ids[1] = rb_intern("length");
+        ids[2] = rb_intern("on_fault");
+        rb_get_kwargs(opts, ids, 0, 3, vals);
     }
-    if (i_mm->t->flag & MM_ANON)
+    if (vals[2] != Qundef && RTEST(vals[2]))
     {
-        rb_raise(rb_eArgError, "mlock(anonymous)");
+#if defined(HAVE_MLOCK2) && defined(MLOCK_ONFAULT)
+        flag = MM_ONFAULT;
+#else
+        rb_raise(rb_eNotImpError, "mlock(on_fault: true) is not available");
+#endif
     }
-    if (mlock(i_mm->t->addr, i_mm->t->len) == -1)
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    all = mm_i_lock_range(i_mm, vals, &beg, &end);
+    if (beg < end && mm_i_mlock(MM_BASE(i_mm->t) + beg, end - beg, flag) == -1)
     {
         rb_raise(rb_eArgError, "mlock(%d)", errno);
     }
-    i_mm->t->flag |= MM_LOCK;
+    if (all)
+    {
+        i_mm->t->flag = (i_mm->t->flag & ~MM_ONFAULT) | MM_LOCK | flag;
+    }
     return obj;
 }
 
@@ -2448,30 +6275,44 @@ mm_mlock(VALUE obj)
  * Document-method: munlock
  * Document-method: unlock
  *
- * call-seq: unlock
+ * call-seq: munlock(offset: 0, length: size - offset)
  *
- * reenable paging
+ * reenable paging, for the whole map or only the pages of the range
  */
 static VALUE
-mm_munlock(VALUE obj)
+mm_munlock(int argc, VALUE *argv, VALUE obj)
 {
     mm_ipc *i_mm;
+    VALUE opts, vals[2] = {Qundef, Qundef};
+    ID ids[2];
+    size_t beg, end;
+    int all;
 
-    Data_Get_Struct(obj, mm_ipc, i_mm);
-    if (!(i_mm->t->flag & MM_LOCK))
+    rb_scan_args(argc, argv, "0:", &opts);
+    if (!NIL_P(opts))
     {
-        return obj;
+        ids[0] = rb_intern("offset");
+        ids[1] = rb_intern("length");
+        rb_get_kwargs(opts, ids, 0, 2, vals);
     }
-    if (munlock(i_mm->t->addr, i_mm->t->len) == -1)
+    GetMmap(obj, i_mm, 0);
+    MM_CHECK_WINDOW(i_mm);
+    all = mm_i_lock_range(i_mm, vals, &beg, &end);
+    if (beg < end && munlock(MM_BASE(i_mm->t) + beg, end - beg) == -1)
     {
         rb_raise(rb_eArgError, "munlock(%d)", errno);
     }
-    i_mm->t->flag &= ~MM_LOCK;
+    if (all)
+    {
+        i_mm->t->flag &= ~(MM_LOCK | MM_ONFAULT);
+    }
     return obj;
 }
 
 void Init_mmap()
 {
+    mm_pagesize = sysconf(_SC_PAGESIZE);
+    mm_hugepagesize = mm_i_hugepagesize();
     if (rb_const_defined_at(rb_cObject, rb_intern("Mmap")))
     {
         mm_cMap = rb_const_get(rb_cObject, rb_intern("Mmap"));
@@ -2494,6 +6335,33 @@ void Init_mmap()
     rb_define_const(mm_cMap, "MADV_WILLNEED", INT2FIX(MADV_WILLNEED));
     rb_define_const(mm_cMap, "MADV_DONTNEED", INT2FIX(MADV_DONTNEED));
 #endif
+#ifdef MADV_HUGEPAGE
+    rb_define_const(mm_cMap, "MADV_HUGEPAGE", INT2FIX(MADV_HUGEPAGE));
+    rb_define_const(mm_cMap, "MADV_NOHUGEPAGE", INT2FIX(MADV_NOHUGEPAGE));
+#endif
+#ifdef MADV_FREE
+    rb_define_const(mm_cMap, "MADV_FREE", INT2FIX(MADV_FREE));
+#endif
+#ifdef MADV_REMOVE
+    rb_define_const(mm_cMap, "MADV_REMOVE", INT2FIX(MADV_REMOVE));
+#endif
+#ifdef MADV_DONTDUMP
+    rb_define_const(mm_cMap, "MADV_DONTDUMP", INT2FIX(MADV_DONTDUMP));
+    rb_define_const(mm_cMap, "MADV_DODUMP", INT2FIX(MADV_DODUMP));
+#endif
+#ifdef MADV_COLD
+    rb_define_const(mm_cMap, "MADV_COLD", INT2FIX(MADV_COLD));
+#endif
+#ifdef MADV_PAGEOUT
+    rb_define_const(mm_cMap, "MADV_PAGEOUT", INT2FIX(MADV_PAGEOUT));
+#endif
+#ifdef MADV_POPULATE_READ
+    rb_define_const(mm_cMap, "MADV_POPULATE_READ", INT2FIX(MADV_POPULATE_READ));
+    rb_define_const(mm_cMap, "MADV_POPULATE_WRITE", INT2FIX(MADV_POPULATE_WRITE));
+#endif
+#ifdef MAP_HUGETLB
+    rb_define_const(mm_cMap, "MAP_HUGETLB", INT2FIX(MAP_HUGETLB));
+#endif
 #ifdef MAP_DENYWRITE
     rb_define_const(mm_cMap, "MAP_DENYWRITE", INT2FIX(MAP_DENYWRITE));
 #endif
@@ -2535,19 +6403,28 @@ void Init_mmap()
     rb_define_method(mm_cMap, "munmap", mm_unmap, 0);
     rb_define_method(mm_cMap, "msync", mm_msync, -1);
     rb_define_method(mm_cMap, "sync", mm_msync, -1);
-    rb_define_method(mm_cMap, "flush", mm_msync, -1);
+    rb_define_method(mm_cMap, "flush", mm_flush, -1);
+    rb_define_method(mm_cMap, "dirty_ranges", mm_dirty_ranges, 0);
+    rb_define_method(mm_cMap, "flushed_offset", mm_flushed_offset, 0);
     rb_define_method(mm_cMap, "mprotect", mm_mprotect, 1);
     rb_define_method(mm_cMap, "protect", mm_mprotect, 1);
 #ifdef MADV_NORMAL
-    rb_define_method(mm_cMap, "madvise", mm_madvise, 1);
-    rb_define_method(mm_cMap, "advise", mm_madvise, 1);
+    rb_define_method(mm_cMap, "madvise", mm_madvise, -1);
+    rb_define_method(mm_cMap, "advise", mm_madvise, -1);
 #endif
-    rb_define_method(mm_cMap, "mlock", mm_mlock, 0);
-    rb_define_method(mm_cMap, "lock", mm_mlock, 0);
-    rb_define_method(mm_cMap, "munlock", mm_munlock, 0);
-    rb_define_method(mm_cMap, "unlock", mm_munlock, 0);
+    rb_define_method(mm_cMap, "hugepage_bytes", mm_hugepage_bytes, 0);
+    rb_define_method(mm_cMap, "memory_stats", mm_memory_stats, 0);
+    rb_define_method(mm_cMap, "residency", mm_residency, -1);
+    rb_define_method(mm_cMap, "warmup", mm_warmup, -1);
+    rb_define_method(mm_cMap, "prefetch", mm_prefetch_m, -1);
+    rb_define_method(mm_cMap, "mlock", mm_mlock, -1);
+    rb_define_method(mm_cMap, "lock", mm_mlock, -1);
+    rb_define_method(mm_cMap, "munlock", mm_munlock, -1);
+    rb_define_method(mm_cMap, "unlock", mm_munlock, -1);
 
     rb_define_method(mm_cMap, "extend", mm_extend, 1);
+    rb_define_method(mm_cMap, "reserve", mm_reserve, 1);
+    rb_define_method(mm_cMap, "capacity", mm_capacity, 0);
     rb_define_method(mm_cMap, "<=>", mm_cmp, 1);
     rb_define_method(mm_cMap, "==", mm_equal, 1);
     rb_define_method(mm_cMap, "===", mm_equal, 1);
@@ -2570,6 +6447,7 @@ void Init_mmap()
 #endif
     rb_define_method(mm_cMap, "index", mm_index, -1);
     rb_define_method(mm_cMap, "rindex", mm_rindex, -1);
+    rb_define_method(mm_cMap, "casecmp_index", mm_casecmp_index, -1);
 
     rb_define_method(mm_cMap, "to_str", mm_to_str, 0);
 
@@ -2579,6 +6457,7 @@ void Init_mmap()
     rb_define_method(mm_cMap, "swapcase!", mm_swapcase_bang, 0);
 
     rb_define_method(mm_cMap, "split", mm_split, -1);
+    rb_define_method(mm_cMap, "scan", mm_scan, 1);
     rb_define_method(mm_cMap, "reverse!", mm_reverse_bang, 0);
     rb_define_method(mm_cMap, "concat", mm_concat, 1);
     rb_define_method(mm_cMap, "<<", mm_concat, 1);
@@ -2588,6 +6467,8 @@ void Init_mmap()
 
     rb_define_method(mm_cMap, "sub!", mm_sub_bang, -1);
     rb_define_method(mm_cMap, "gsub!", mm_gsub_bang, -1);
+    rb_define_method(mm_cMap, "replace_all", mm_replace_all, 2);
+    rb_define_method(mm_cMap, "apply_edits", mm_apply_edits, 1);
     rb_define_method(mm_cMap, "strip!", mm_strip_bang, 0);
 #if HAVE_RB_STR_LSTRIP
     rb_define_method(mm_cMap, "lstrip!", mm_lstrip_bang, 0);
@@ -2597,6 +6478,7 @@ void Init_mmap()
     rb_define_method(mm_cMap, "chomp!", mm_chomp_bang, -1);
 
     rb_define_method(mm_cMap, "count", mm_count, -1);
+    rb_define_method(mm_cMap, "byte_histogram", mm_byte_histogram, 0);
 
     rb_define_method(mm_cMap, "tr!", mm_tr_bang, 2);
     rb_define_method(mm_cMap, "tr_s!", mm_tr_s_bang, 2);
@@ -2606,6 +6488,15 @@ void Init_mmap()
     rb_define_method(mm_cMap, "sum", mm_sum, -1);
 
     rb_define_method(mm_cMap, "slice", mm_aref_m, -1);
+    rb_define_method(mm_cMap, "windowed?", mm_windowed, 0);
+    rb_define_method(mm_cMap, "editing", mm_editing, 0);
+    rb_define_method(mm_cMap, "editing=", mm_editing_set, 1);
+    rb_define_method(mm_cMap, "compact!", mm_compact_bang, 0);
+    rb_define_method(mm_cMap, "view", mm_view, 2);
+    rb_define_method(mm_cMap, "each_line", mm_each_line, -1);
+    rb_define_method(mm_cMap, "each_byte", mm_each_byte, 0);
+    rb_define_method(mm_cMap, "each", mm_each_byte, 0);
+    rb_define_method(mm_cMap, "each_byte_slice", mm_each_byte_slice, 1);
     rb_define_method(mm_cMap, "slice!", mm_slice_bang, -1);
     rb_define_method(mm_cMap, "semlock", mm_semlock, -1);
     rb_define_method(mm_cMap, "ipc_key", mm_ipc_key, 0);
@@ -2614,5 +6505,32 @@ void Init_mmap()
     rb_define_private_method(mm_cMap, "set_offset", mm_set_offset, 1);
     rb_define_private_method(mm_cMap, "set_advice", mm_set_advice, 1);
     rb_define_private_method(mm_cMap, "set_increment", mm_set_increment, 1);
+    rb_define_private_method(mm_cMap, "set_growth", mm_set_growth, 1);
+    rb_define_private_method(mm_cMap, "set_max_size", mm_set_max_size, 1);
+    rb_define_private_method(mm_cMap, "set_hugepages", mm_set_hugepages, 1);
+    rb_define_private_method(mm_cMap, "set_populate", mm_set_populate, 1);
+    rb_define_private_method(mm_cMap, "set_window", mm_set_window, 1);
+    rb_define_private_method(mm_cMap, "set_windows", mm_set_windows, 1);
+    rb_define_private_method(mm_cMap, "set_flush_interval", mm_set_flush_interval, 1);
+    rb_define_private_method(mm_cMap, "set_editing", mm_set_editing, 1);
+    rb_define_private_method(mm_cMap, "window_size", mm_window_size, 0);
     rb_define_private_method(mm_cMap, "set_ipc", mm_set_ipc, 1);
+
+    mm_cPrefetch = rb_define_class_under(mm_cMap, "Prefetch", rb_cObject);
+    rb_undef_alloc_func(mm_cPrefetch);
+    rb_define_method(mm_cPrefetch, "wait", mm_prefetch_wait, 0);
+    rb_define_method(mm_cPrefetch, "done?", mm_prefetch_done, 0);
+
+    mm_cSlice = rb_define_class_under(mm_cMap, "Slice", rb_cObject);
+    rb_undef_alloc_func(mm_cSlice);
+    rb_define_method(mm_cSlice, "to_str", mm_slice_to_str, 0);
+    rb_define_method(mm_cSlice, "to_s", mm_slice_to_s, 0);
+    rb_define_method(mm_cSlice, "size", mm_slice_size, 0);
+    rb_define_method(mm_cSlice, "length", mm_slice_size, 0);
+    rb_define_method(mm_cSlice, "offset", mm_slice_offset, 0);
+    rb_define_method(mm_cSlice, "map", mm_slice_map, 0);
+    rb_define_method(mm_cSlice, "[]", mm_slice_aref, -1);
+    rb_define_method(mm_cSlice, "slice", mm_slice_aref, -1);
+    rb_define_method(mm_cSlice, "byteslice", mm_slice_aref, -1);
+    rb_define_private_method(mm_cSlice, "view_send", mm_slice_send, -1);
 }
@@ -21,40 +21,151 @@ class Mmap
     raise TypeError, "can't dup instance of #{self.class}"
   end
 
-  # call-seq: scan(pattern, &block)
+  # A read-only part of a Mmap, see Mmap#view
   #
-  # return an array of all occurence matched by <em>pattern</em>
-  def scan(pattern, &block)
-    to_str.scan(pattern, &block)
-  end
+  # String methods which do not modify the receiver read the mapped bytes
+  # through #to_str, only the strings they return or yield are copied.
+  # #to_str is only valid while the map is mapped and unchanged, the
+  # strings derived from it can share the map, use #to_s to get a copy
+  class Slice
+    include Comparable
 
-  # Document-method: each_line
-  #
-  # call-seq:
-  #    each(rs = $/, &block)
-  #
-  # iterate on each line
-  def each_line(...)
-    to_str.each_line(...)
+    # call-seq: view(offset, length)
+    #
+    # return a Mmap::Slice for a part of this slice
+    def view(off, len)
+      off += size if off.negative?
+      raise IndexError, "invalid range #{off}, #{len}" if off.negative? || off > size || len.negative?
+
+      map.view(offset + off, [len, size - off].min)
+    end
+
+    def <=>(other)
+      to_str <=> (other.is_a?(Slice) ? other.to_str : other)
+    end
+
+    def ==(other)
+      return false unless other.respond_to?(:to_str)
+
+      to_str == other.to_str
+    end
+    alias eql? ==
+
+    def hash # :nodoc:
+      to_str.hash
+    end
+
+    def inspect # :nodoc:
+      "#<#{self.class} offset=#{offset} length=#{size}>"
+    end
+
+    private
+
+    def method_missing(name, *args, **kwargs, &block)
+      return super if name.end_with?('!') || !''.respond_to?(name)
+
+      view_send(name, *args, **kwargs, &block)
+    end
+
+    def respond_to_missing?(name, include_private = false)
+      (!name.end_with?('!') && ''.respond_to?(name)) || super
+    end
   end
 
-  # call-seq: each_byte(&block)
-  #
-  # iterate on each byte
-  def each_byte(&block)
-    to_str.each_byte(&block)
+  # Translation of the offsets of a map before Mmap#apply_edits into the
+  # offsets after it
+  class OffsetMap
+    def initialize(begs, ends, shifts) # :nodoc:
+      @begs = begs
+      @ends = ends
+      @shifts = shifts
+    end
+
+    # number of edits
+    def size
+      @begs.size
+    end
+
+    # call-seq: translate(offset)
+    #
+    # return the new offset of the byte at <em>offset</em>, an offset in a
+    # replaced range gives the start of its replacement
+    def translate(offset)
+      i = (@begs.bsearch_index { |beg| beg > offset } || @begs.size) - 1
+      return offset if i.negative?
+      return @begs[i] + (i.zero? ? 0 : @shifts[i - 1]) if offset < @ends[i]
+
+      offset + @shifts[i]
+    end
+    alias [] translate
+
+    def inspect # :nodoc:
+      "#<#{self.class} edits=#{size}>"
+    end
   end
-  alias each each_byte
 
   private
 
+  # each_line for a windowed map, called by the native each_line
+  def each_window_line(sep = $/, chomp: false, offsets: false, view: false)
+    if sep.nil? || sep.empty?
+      raise ArgumentError, 'offsets: and view: need a separator' if offsets || view
+
+      return each_chunk { |chunk| chunk.each_line(sep, chomp: chomp) { |line| yield line } }
+    end
+
+    pos = 0
+    rest = +''
+    emit = lambda do |line|
+      len = line.size
+      line.chomp!(sep) if chomp
+      if offsets then yield pos, line.size
+      elsif view then yield view(pos, line.size)
+      else yield line
+      end
+      pos += len
+    end
+    each_chunk do |chunk|
+      # a separator can start in the part of the previous chunk left over
+      from = [rest.bytesize - sep.bytesize + 1, 0].max
+      rest << chunk
+      start = 0
+      while (i = rest.index(sep, from))
+        emit.call(rest.byteslice(start, i + sep.bytesize - start))
+        start = from = i + sep.bytesize
+      end
+      rest = rest.byteslice(start, rest.bytesize - start) if start.positive?
+    end
+    emit.call(rest) unless rest.empty?
+    self
+  end
+
+  # each_byte for a windowed map, called by the native each_byte
+  def each_window_byte(&block)
+    each_chunk { |chunk| chunk.each_byte(&block) }
+    self
+  end
+
+  def each_chunk
+    step = window_size
+    0.step(size - 1, step) { |off| yield self[off, step] }
+  end
+
   def process_options(options)
     options.each do |k, v|
-      case k
+      case k.to_s
       when 'length' then set_length v
       when 'offset' then set_offset v
       when 'advice' then set_advice v
       when 'increment' then set_increment v
+      when 'growth' then set_growth v
+      when 'max_size' then set_max_size v
+      when 'hugepages' then set_hugepages v
+      when 'populate' then set_populate v
+      when 'window' then set_window v
+      when 'windows' then set_windows v
+      when 'flush_interval' then set_flush_interval v
+      when 'editing' then set_editing v
       when 'initialize' # skip
       when 'ipc' then set_ipc v
       else
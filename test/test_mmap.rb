@@ -1,5 +1,6 @@
 require 'mmap'
 require 'fileutils'
+require 'fiddle'
 require 'tempfile'
 require 'minitest/autorun'
 
@@ -279,6 +280,101 @@ class TestMmap < Minitest::Test
     end
   end
 
+  def test_grow_and_shrink
+    chunk = 'x' * 10_000
+    100.times do
+      @mmap << chunk
+      @str << chunk
+    end
+    assert_equal(@str, @mmap.to_str, 'grow')
+    @mmap.slice!(0, 500_000)
+    @str.slice!(0, 500_000)
+    @mmap.msync
+    assert_equal(@str, internal_read[0, @str.size], 'shrink')
+    @mmap.unmap
+    assert_equal(@str.size, File.size(@mmap_c), 'truncate on unmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+  end
+
+  def test_growth
+    @mmap.unmap
+    @mmap = Mmap.new(@mmap_c, 'rw', growth: { factor: 2, max: 1 << 20 })
+    capa = @mmap.capacity
+    @mmap << 'x'
+    @str << 'x'
+    assert_operator(@mmap.capacity, :>=, capa * 2, 'geometric')
+    assert_operator(@mmap.reserve(3 << 20), :>=, @mmap.size + (3 << 20), 'reserve')
+    @mmap.unmap
+    assert_equal(@str, internal_read, 'trim on unmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'rw', growth: 0.5) }
+  end
+
+  def test_max_size
+    @mmap.unmap
+    @mmap = Mmap.new(@mmap_c, 'rw', max_size: 4 << 20)
+    view = @mmap.to_str
+    before = view.size
+    @mmap << ('y' * (1 << 20))
+    @str << ('y' * (1 << 20))
+    assert_equal(@str, @mmap.to_str, 'grow in place')
+    assert_equal(Fiddle::Pointer[view].to_i, Fiddle::Pointer[@mmap.to_str].to_i, 'address kept')
+    assert_equal(@str[0, before], view, 'content kept')
+    assert_raises(ArgumentError) { @mmap.extend(8 << 20) }
+    @mmap.slice!(0, 1 << 19)
+    @str.slice!(0, 1 << 19)
+    @mmap.msync
+    assert_equal(@str, @mmap.to_str, 'shrink')
+    assert_equal(@str, internal_read[0, @str.size], 'shrink')
+    @mmap.unmap
+    assert_equal(@str, internal_read, 'truncate on unmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+  end
+
+  def test_dirty_flush
+    size = @mmap.size
+    assert_equal([], @mmap.dirty_ranges, 'clean')
+    @mmap[5000, 3] = 'abc'
+    @mmap[20_000] = 'z'
+    @mmap << 'end'
+    ranges = @mmap.dirty_ranges
+    assert(ranges.any? { |off, len| off <= 5000 && 5003 <= off + len }, 'aset')
+    assert(ranges.any? { |off, len| off <= size && size + 3 <= off + len }, 'cat')
+    assert(ranges.sum { |_, len| len } < size, 'ranges')
+    @mmap.msync(5000, 3)
+    assert(@mmap.dirty_ranges.none? { |off, len| off <= 5000 && 5003 <= off + len }, 'ranged msync')
+    @mmap.flush
+    assert_equal([], @mmap.dirty_ranges, 'flush')
+    @mmap.gsub!(/rb_/, 'RB_')
+    assert_equal(false, @mmap.dirty_ranges.empty?, 'gsub!')
+    @mmap.flush(Mmap::MS_ASYNC)
+    assert_equal('abc', File.binread(@mmap_c, 3, 5000), 'write')
+    assert_raises(IndexError) { @mmap.msync(-1, 3) }
+  end
+
+  def test_async_flush
+    @mmap << ('z' * 10_000)
+    @mmap.flush(async: true)
+    @mmap << 'tail'
+    @mmap.flush
+    assert_equal(@mmap.size, @mmap.flushed_offset, 'flushed_offset')
+    @mmap.unmap
+    @mmap = Mmap.new(@mmap_c, 'rw', flush_interval: 0.01)
+    @mmap << 'more'
+    20.times do
+      break if @mmap.flushed_offset == @mmap.size
+
+      sleep 0.01
+    end
+    assert_equal(@mmap.size, @mmap.flushed_offset, 'flush_interval')
+    @mmap << ('w' * 100_000)
+    @mmap.flush(async: true)
+    @mmap.unmap
+    assert_equal('w' * 100, File.binread(@mmap_c)[-100..-1], 'joined on unmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'r', flush_interval: 1) }
+  end
+
   def test_msync
     3.times do |_i|
       [@mmap, @str].each { |l| l << ('x' * 4096) }
@@ -318,6 +414,514 @@ class TestMmap < Minitest::Test
     assert_raises(TypeError) { @mmap << 'a' }
   end
 
+  def test_anonymous_grow
+    return unless defined?(Mmap::MAP_ANONYMOUS)
+
+    m0 = Mmap.new(nil, 12)
+    str = "\0" * 12
+    [m0, str].each { |m| m << ('z' * 100_000) }
+    assert_equal(str, m0.to_str, 'append')
+    [m0, str].each { |m| m[1..2] = 'abc' }
+    assert_equal(str, m0.to_str, 'aset')
+    m0.extend(4096)
+    [m0, str].each { |m| m.slice!(0, 90_000) }
+    m0.msync
+    assert_equal(str, m0.to_str, 'shrink')
+    assert_nil(m0.munmap, 'munmap')
+  end
+
+  def test_hugepages
+    return unless defined?(Mmap::MADV_HUGEPAGE)
+
+    m0 = Mmap.new(nil, 4 << 20, hugepages: :transparent)
+    m0[0, 3] = 'abc'
+    assert_equal('abc', m0[0, 3], 'transparent')
+    assert_kind_of(Integer, m0.hugepage_bytes, 'hugepage_bytes')
+    assert_nil(m0.munmap, 'munmap')
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'r', hugepages: :explicit) }
+    assert_raises(ArgumentError) { Mmap.new(nil, 4096, hugepages: :gigantic) }
+  end
+
+  def test_populate_and_warmup
+    @mmap.unmap
+    @mmap = Mmap.new(@mmap_c, 'rw', populate: true)
+    assert_equal(@str, @mmap.to_str, 'populate')
+    @mmap << ('p' * 100_000)
+    @str << ('p' * 100_000)
+    assert_equal(@mmap, @mmap.warmup(threads: 4), 'warmup')
+    assert_equal(@mmap, @mmap.warmup, 'warmup')
+    assert_equal(@str, @mmap.to_str, 'warmup')
+    assert_raises(ArgumentError) { @mmap.warmup(threads: 0) }
+    assert_equal(@mmap, @mmap.warmup(threads: 1_000_000), 'threads clamped')
+    m0 = Mmap.new(nil, 'length' => 64 << 20)
+    worker = Thread.new { m0.warmup(threads: 2) }
+    locked = 0
+    while worker.alive?
+      begin
+        m0.extend(0)
+      rescue RuntimeError
+        locked += 1
+      end
+      Thread.pass
+    end
+    assert_equal(m0, worker.value, 'warmup in a thread')
+    assert_operator(locked, :>, 0, 'map locked without the GVL')
+    m0.munmap
+  end
+
+  def test_window
+    m0 = Mmap.new(@mmap_c, 'r', window: 4096, windows: 2)
+    assert_equal(true, m0.windowed?, 'windowed?')
+    assert_equal(@str.size, m0.size, 'size')
+    [5, -7, 4095, 4096, 12_287, @str.size + 3].each do |i|
+      assert_same_result(@str[i], m0[i], 'aref')
+      assert_same_result(@str[i, 10_000], m0[i, 10_000], 'double aref')
+      assert_same_result(@str[i..(i + 5000)], m0[i..(i + 5000)], 'range aref')
+    end
+    %w[rb_raise mm_cMap Init_mmap XXXXX].each do |sub|
+      assert_same_result(@str.index(sub), m0.index(sub), 'index')
+      assert_same_result(@str.index(sub, 9000), m0.index(sub, 9000), 'index')
+    end
+    assert_equal(@str.each_line.to_a, m0.each_line.to_a, 'each_line')
+    assert_equal(@str.each_line('in', chomp: true).to_a,
+                 m0.each_line('in', chomp: true).to_a, 'each_line')
+    ['rb_', "\n\n", 'static VALUE', 'XXXXX'].each do |sep|
+      assert_equal(@str.each_line(sep).to_a, m0.each_line(sep).to_a, "each_line(#{sep.inspect})")
+    end
+    assert_equal(@str.bytes, m0.to_a, 'each_byte')
+    assert_raises(TypeError) { m0.to_str }
+    assert_raises(TypeError) { m0.index(/rb/) }
+    assert_equal(false, m0.frozen?, 'not frozen')
+    assert_match(/read-only/, assert_raises(TypeError) { m0[0] = 'x' }.message, 'read-only')
+    assert_raises(TypeError) { m0 << 'x' }
+    assert_nil(m0.munmap, 'munmap')
+    fds = Dir.children('/proc/self/fd').size if File.directory?('/proc/self/fd')
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'rw', window: 4096) }
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'r', editing: :gap) }
+    assert_equal(fds, Dir.children('/proc/self/fd').size, 'fd closed') if fds
+  end
+
+  def test_view
+    v = @mmap.view(5000, 4096)
+    assert_equal(@str[5000, 4096], v.to_str, 'to_str')
+    assert_equal(4096, v.size, 'size')
+    assert_equal(5000, v.offset, 'offset')
+    assert_equal(true, v.to_str.frozen?, 'frozen')
+    assert_equal(@str[5000, 4096].index('rb_'), v.index('rb_'), 'delegate')
+    assert_equal(@str[5010, 10], v.view(10, 10).to_s, 'view of view')
+    assert_equal(@str[-10..-1], @mmap.view(-10, 100).to_s, 'clipped')
+    assert(v == @str[5000, 4096], '==')
+    m0 = Mmap.new(@mmap_c, 'r', window: 4096)
+    assert_equal(@str[4000, 5000], m0.view(4000, 5000).to_s, 'windowed')
+    m0.munmap
+    assert_raises(IOError) { m0.view(0, 1) }
+    copy = v.to_s
+    @mmap[5000, 3] = 'abc'
+    assert_equal('abc', v[0, 3], 'reads the map')
+    assert_equal(@str[5000, 3], copy[0, 3], 'copy')
+    assert_raises(NoMethodError) { v.upcase! }
+    assert_raises(IndexError) { @mmap.view(@mmap.size + 1, 1) }
+    v = @mmap.view(@mmap.size - 100, 100)
+    tail = v[1..]
+    subbed = v.sub('x', 'y')
+    head = v.byteslice(0, 3)
+    fields = v.split('_')
+    first = v.unpack1('a10')
+    lines = []
+    v.each_line { |l| lines << l }
+    expected = v.to_s
+    assert_equal([expected[0], expected[-1], nil, nil], [v[0], v[-1], v[100], v[0, -1]], 'index')
+    assert_equal([expected[2..5], expected[98, 10], ''], [v[2..5], v[98, 10], v[100, 1]], 'ranges')
+    assert_equal(expected.b[/r(b)_/, 1], v[/r(b)_/, 1], 'regexp')
+    @mmap.munmap
+    GC.start
+    assert_equal(expected[1..], tail, 'delegated substring after munmap')
+    assert_equal(expected.sub('x', 'y'), subbed, 'delegated sub after munmap')
+    assert_equal(expected[0, 3], head, 'byteslice after munmap')
+    assert_equal(expected.split('_'), fields, 'split after munmap')
+    assert_equal(expected[0, 10], first, 'unpack1 after munmap')
+    assert_equal(expected.each_line.to_a, lines, 'yielded after munmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+  end
+
+  def test_each_line_native
+    ['in', "\n", 'rb_'].each do |sep|
+      [false, true].each do |chomp|
+        assert_equal(@str.each_line(sep, chomp: chomp).to_a,
+                     @mmap.each_line(sep, chomp: chomp).to_a, "each_line(#{sep.inspect})")
+      end
+    end
+    assert_equal(@str.each_line.to_a, @mmap.each_line.to_a, 'default')
+    assert_equal([@str], @mmap.each_line(nil).to_a, 'nil')
+    assert_equal(@str.each_line('').to_a, @mmap.each_line('').to_a, 'paragraph')
+    lines = @str.each_line.to_a
+    pos = 0
+    @mmap.each_line(offsets: true).with_index do |(off, len), i|
+      assert_equal([pos, lines[i].size], [off, len], 'offsets')
+      pos += len
+    end
+    views = @mmap.each_line(view: true).to_a
+    assert_instance_of(Mmap::Slice, views[3], 'view')
+    assert_equal(lines[3], views[3].to_s, 'view')
+    m0 = Mmap.new(@mmap_c, 'r', window: 4096)
+    assert_equal(@mmap.each_line(offsets: true).to_a, m0.each_line(offsets: true).to_a, 'windowed')
+    m0.munmap
+    assert_equal(@mmap, @mmap.each_line { nil }, 'return self')
+  end
+
+  def test_each_byte_native
+    assert_equal(@str.bytes, @mmap.each_byte.to_a, 'each_byte')
+    assert_equal(@str.size, @mmap.each.size, 'enumerator size')
+    assert_equal(@str.bytes.max, @mmap.max, 'Enumerable')
+    slices = @mmap.each_byte_slice(4096).to_a
+    assert_equal((@str.size + 4095) / 4096, slices.size, 'slices')
+    assert_equal(slices.size, @mmap.each_byte_slice(4096).size, 'enumerator size')
+    assert_instance_of(Mmap::Slice, slices.first, 'view')
+    assert_equal(@str, slices.map(&:to_s).join, 'slices')
+    assert_equal(@str.size % 4096, slices.last.size, 'last slice')
+    assert_raises(ArgumentError) { @mmap.each_byte_slice(0) }
+    m0 = Mmap.new(@mmap_c, 'r', window: 4096)
+    assert_equal(@str.bytes, m0.each_byte.to_a, 'windowed')
+    assert_equal(@str, m0.each_byte_slice(1000).map(&:to_s).join, 'windowed slices')
+    m0.munmap
+  end
+
+  def test_native_search
+    %w[rb_raise mm_cMap Init_mmap XXXXX i].each do |sub|
+      [nil, 0, 9000, -5000, @str.size, @str.size + 1].each do |pos|
+        args = pos ? [sub, pos] : [sub]
+        assert_same_result(@str.index(*args), @mmap.index(*args), "index(#{args.inspect})")
+        assert_same_result(@str.rindex(*args), @mmap.rindex(*args), "rindex(#{args.inspect})")
+      end
+      assert_equal(@str.include?(sub), @mmap.include?(sub), 'include?')
+      assert_equal(@str.downcase.index(sub.downcase),
+                   @mmap.casecmp_index(sub.upcase), 'casecmp_index')
+    end
+    assert_equal(@str.rindex(''), @mmap.rindex(''), 'empty')
+    assert_equal(@str.index(/rb_\w+/), @mmap.index(/rb_\w+/), 'regexp')
+    assert_equal('rb_', $~ && $~[0][0, 3], 'last match')
+    m0 = Mmap.new(@mmap_c, 'r', offset: 4096, length: 100)
+    assert_equal(@str.index(@str[4096, 100]), @mmap.index(m0), 'Mmap needle')
+    assert_equal(0, @mmap.casecmp(@str.swapcase), 'casecmp')
+    assert_equal(@str.casecmp(@str[0..-2]), @mmap.casecmp(@str[0..-2]), 'casecmp shorter')
+    assert_equal(@str.casecmp('zz'), @mmap.casecmp('ZZ'), 'casecmp other')
+    m0.munmap
+    m0 = Mmap.new(nil, 'length' => 2 << 20, 'initialize' => 'X')
+    m0[-2, 2] = 'xQ'
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    assert_equal(m0.size - 2, m0.casecmp_index('xq'), 'casecmp_index on repeated first bytes')
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - elapsed
+    assert_operator(elapsed, :<, 1, 'casecmp_index is linear')
+    m0.munmap
+  end
+
+  def test_native_count_delete
+    [%w[a], %w[a-z], %w[^a-z], %w[a-z ^aeiou], ['\\-_'], %w[-a z-], %w[^]].each do |sets|
+      assert_equal(@str.count(*sets), @mmap.count(*sets), "count(#{sets.inspect})")
+    end
+    assert_raises(ArgumentError) { @mmap.count }
+    assert_raises(ArgumentError) { @mmap.count('z-a') }
+    hist = @mmap.byte_histogram
+    assert_equal(256, hist.size, 'histogram')
+    assert_equal(@str.bytes.tally.sort, hist.each_with_index.reject { |n, _| n.zero? }.map(&:reverse), 'histogram')
+    assert_equal(@str.delete('a-y'), @mmap.delete!('a-y').to_str, 'delete!')
+    assert_nil(@mmap.delete!('a-y'), 'nothing deleted')
+    @mmap.flush
+    @str.delete!('a-y')
+    assert_equal(@str, internal_read[0, @str.size], 'flushed')
+  end
+
+  def test_gsub_single_pass
+    [[/rb_(\w)/, 'RUBY_\\1_'], [/static\s+/, ''], [/mm_/, 'mm'], [/\b/, '|'], [/i/, 'i']].each do |pat, repl|
+      @mmap.gsub!(pat, repl)
+      @str.gsub!(pat, repl)
+      assert_equal(@str, @mmap.to_str, "gsub!(#{pat.inspect}, #{repl.inspect})")
+    end
+    @mmap.gsub!(/[a-z]+/) { |w| w.size.even? ? w.upcase : '' }
+    @str.gsub!(/[a-z]+/) { |w| w.size.even? ? w.upcase : '' }
+    assert_equal(@str, @mmap.to_str, 'block')
+    @mmap.flush
+    assert_equal(@str, internal_read[0, @str.size], 'flushed')
+    assert_raises(RuntimeError) { @mmap.gsub!(/VALUE/) { @mmap << 'x' * 100_000 } }
+  end
+
+  def test_literal_sub
+    [%w[VALUE V], %w[mm_ mmap_], %w[rb_raise rb_raise], %w[XXXXX y]].each do |from, to|
+      assert_equal(@str.sub!(from, to).nil?, @mmap.sub!(from, to).nil?, "sub!(#{from}, #{to})")
+      assert_equal(@str, @mmap.to_str, "sub!(#{from}, #{to})")
+      assert_equal(@str.gsub!(from, to).nil?, @mmap.gsub!(from, to).nil?, "gsub!(#{from}, #{to})")
+      assert_equal(@str, @mmap.to_str, "gsub!(#{from}, #{to})")
+    end
+    @mmap.gsub!('int', '<\\0>')
+    @str.gsub!('int', '<\\0>')
+    assert_equal(@str, @mmap.to_str, 'backslash')
+    @mmap.gsub!('static', @mmap.to_str[-200..])
+    @str.gsub!('static', @str[-200..])
+    assert_equal(@str, @mmap.to_str, 'replacement in the map')
+    @mmap.sub!(@mmap.to_str[-300..], 'y' * 100_000)
+    @str.sub!(@str[-300..], 'y' * 100_000)
+    assert_equal(@str, @mmap.to_str, 'pattern in the map')
+    @mmap.gsub!(/Init_mmap/, @mmap.to_str[-200..])
+    @str.gsub!(/Init_mmap/, @str[-200..])
+    assert_equal(@str, @mmap.to_str, 'regexp replacement in the map')
+    @str << 'static' * 3
+    @mmap << 'static' * 3
+    count = @str.scan('static').size
+    assert_equal(count, @mmap.replace_all('static', 'STATIC_'), 'replace_all')
+    @str.gsub!('static') { 'STATIC_' }
+    assert_equal(@str, @mmap.to_str, 'replace_all')
+    assert_equal(0, @mmap.replace_all('static', 'x'), 'no match')
+    assert_raises(ArgumentError) { @mmap.replace_all('', 'x') }
+    @mmap.flush
+    assert_equal(@str, internal_read[0, @str.size], 'flushed')
+    m0 = Mmap.new(nil, 'length' => 16 << 20, 'initialize' => 'a')
+    worker = Thread.new { m0.replace_all('a', 'b') }
+    locked = 0
+    while worker.alive?
+      begin
+        m0.extend(0)
+      rescue RuntimeError
+        locked += 1
+      end
+      Thread.pass
+    end
+    assert_equal(16 << 20, worker.value, 'replace_all in a thread')
+    assert_operator(locked, :>, 0, 'map locked without the GVL')
+    assert_equal(16 << 20, m0.count('b'), 'content')
+    m0.munmap
+  end
+
+  def test_gsub_backref
+    groups = []
+    @mmap.gsub!(/(x)?rb_(\w+)/) do |m|
+      groups << [$~[0], $~[2], $2]
+      m
+    end
+    expected = @str.to_enum(:scan, /(x)?rb_(\w+)/).map { [$~[0], $~[2], $2] }
+    assert_equal(expected, groups, 'in the block')
+    assert_equal(expected.last.first, $~[0], 'last match')
+    assert_equal(expected.last.last, $2, 'group after an unmatched one')
+    @mmap.sub!(/static (\w+)/, 'static  \\1')
+    assert_equal(@str[/static (\w+)/, 1], $1, 'sub!')
+    @mmap[/mm_(\w+)/, 1] = 'MM'
+    assert_equal(@str[/mm_(\w+)/, 1], $1, '[]=')
+    @mmap.munmap
+    assert_equal(@str[/mm_(\w+)/], $~[0], 'after munmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+    @mmap << 'X' * 64
+    expected = @mmap.to_str.gsub('a', 'b' * 10)
+    kept = []
+    @mmap.gsub!(/a|X+\z/) { |x| kept << x; x == 'a' ? 'b' * 10 : x }
+    assert_equal(expected, @mmap.to_str, 'block result in the map')
+    assert_equal('X' * 64, kept.last, 'matched part kept by the block')
+    assert_equal(expected[0...-64], $~.pre_match, 'unchanged match kept on the map')
+    @mmap.sub!(/(?<=(#include ))</, '"')
+    assert_equal('#include '.b, $1, 'group before the match')
+    @mmap.gsub!(/(?<=(incl))ude/, 'UDE')
+    assert_equal('incl'.b, $1, 'group before the last match')
+    @mmap.munmap
+    assert_equal(%w[incl ude].map(&:b), [$1, $~[0]], 'after munmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+  end
+
+  def test_apply_edits
+    edits = [[5000, 10, 'x' * 30], [0, 0, 'head'], [100, 50, ''], [0, 3, 'ABC'],
+             [@str.size, 0, 'tail'], [2000, 1, 'y']]
+    size, map = @mmap.apply_edits(edits)
+    expected = @str.dup
+    edits.sort_by.with_index { |(off), i| [off, i] }.reverse_each do |off, len, repl|
+      expected[off, len] = repl
+    end
+    assert_equal(expected, @mmap.to_str, 'apply_edits')
+    assert_equal(expected.size, size, 'size')
+    assert_equal(edits.size, map.size, 'map size')
+    assert_equal(4, map[0], 'start of a replacement')
+    assert_equal(7, map[3], 'after an insertion and a replacement')
+    assert_equal(@str[2001, 10], @mmap[map[2001], 10], 'translate')
+    assert_equal(map[100], map[120], 'deleted range')
+    assert_equal(map[5000], map[5005], 'replaced range')
+    assert_equal(@str[6000, 10], @mmap[map[6000], 10], 'after a growth')
+    assert_raises(ArgumentError) { @mmap.apply_edits([[10, 5, 'a'], [12, 1, 'b']]) }
+    assert_raises(IndexError) { @mmap.apply_edits([[@mmap.size + 1, 0, 'a']]) }
+    assert_raises(TypeError) { @mmap.apply_edits([[0, 1]]) }
+    assert_equal(expected, @mmap.to_str, 'unchanged after an error')
+    @mmap.flush
+    assert_equal(expected, internal_read[0, expected.size], 'flushed')
+  end
+
+  def test_gap_editing
+    assert_equal(:direct, @mmap.editing, 'default')
+    @mmap.editing = :gap
+    assert_equal(:gap, @mmap.editing, 'gap')
+    pos = 10_000
+    500.times do |i|
+      case i % 4
+      when 0 then @mmap.insert(pos, 'abc'); @str.insert(pos, 'abc')
+      when 1 then @mmap[pos, 5] = ''; @str[pos, 5] = ''
+      when 2 then @mmap[pos - 20, 2] = 'x' * 70_000; @str[pos - 20, 2] = 'x' * 70_000
+      else @mmap[pos + 3] = 'Z'.ord; @str.setbyte(pos + 3, 'Z'.ord)
+      end
+      pos += (i * 7919 % 200) - 100
+    end
+    assert_equal(@str.size, @mmap.size, 'size with a gap')
+    assert_equal(false, @mmap.empty?, 'empty? with a gap')
+    assert_equal(@mmap, @mmap.compact!, 'size keeps the gap')
+    @mmap.insert(3000, 'abc')
+    @str.insert(3000, 'abc')
+    assert_equal(@str[1000, 100], @mmap[1000, 100], 'read closes the gap')
+    @mmap.insert(-1, 'end')
+    @str.insert(-1, 'end')
+    @mmap[5, 0] = 'head'
+    @str[5, 0] = 'head'
+    assert_equal(@mmap, @mmap.compact!, 'compact!')
+    assert_nil(@mmap.compact!, 'no gap')
+    assert_equal(@str, @mmap.to_str, 'content')
+    @mmap[200, 10] = ''
+    @str[200, 10] = ''
+    @mmap.unmap
+    assert_equal(@str, internal_read, 'unmap closes the gap')
+    @mmap = Mmap.new(@mmap_c, 'rw', editing: :gap)
+    assert_equal(:gap, @mmap.editing, 'option')
+    @mmap.editing = :direct
+    assert_raises(ArgumentError) { @mmap.editing = :piece }
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'r', editing: :gap) }
+  end
+
+  def test_cached_view
+    view = @mmap.to_str
+    assert_same(view, @mmap.to_str, 'cached')
+    assert_equal(true, view.frozen?, 'frozen')
+    other = @str.dup.freeze
+    compare = lambda do
+      100.times do
+        @mmap == other
+        @mmap <=> other
+        @mmap.hash
+      end
+    end
+    allocated = lambda do
+      before = GC.stat(:total_allocated_objects)
+      compare.call
+      GC.stat(:total_allocated_objects) - before
+    end
+    allocated.call
+    assert_equal(0, allocated.call, 'no allocation')
+    @mmap[0] = 'Z'
+    assert_equal('Z', @mmap.to_str[0], 'same size write')
+    @mmap << 'tail'
+    refute_same(view, @mmap.to_str, 'invalidated')
+    assert_equal(@str + 'tail', @mmap.to_str.sub('Z', @str[0]), 'content')
+    str = @mmap.to_str + ''
+    tail = @mmap[100..-1]
+    parts = @mmap.split('zzz')
+    found = @mmap.scan(/tail\z/)
+    yielded = []
+    @mmap.scan(/t(a)il\z/) { |m| yielded << m }
+    match = @mmap.match(/(mm_\w+)/)
+    @mmap[-1] = 'L'
+    final = @mmap.to_str + ''
+    @mmap =~ /Init_(mmap)/
+    post = $'
+    assert_equal(final[(final.index('Init_mmap') + 9)..], post, "$' after =~")
+    @mmap.munmap
+    GC.start
+    group, post, pre = $1, $', $`
+    assert_equal(str[100..-1], tail, 'substring after munmap')
+    assert_equal([str], parts, 'split after munmap')
+    assert_equal(['tail'], found, 'scan after munmap')
+    assert_equal([['a']], yielded, 'scan block after munmap')
+    assert_equal(str[/(mm_\w+)/, 1], match[1], 'match after munmap')
+    assert_equal(str[0, match.end(0)], match.pre_match + match[0], 'pre_match after munmap')
+    assert_equal('mmap'.b, group, '$~ after munmap')
+    assert_equal(final, pre + 'Init_mmap' + post, "$` and $' after munmap")
+    assert_equal(final[match.end(0)..], match.post_match, 'post_match after munmap')
+    @mmap = Mmap.new(@mmap_c, 'rw')
+  end
+
+  def test_mlock_range
+    @mmap.mlock(on_fault: true)
+    assert_equal(0, @mmap.memory_stats[:locked], 'on fault')
+    @mmap[0, 3].to_s
+    locked = @mmap.memory_stats[:locked]
+    assert(locked.positive? && locked < @mmap.size, 'faulted')
+    @mmap.munlock
+    @mmap.mlock(offset: 5000, length: 100)
+    assert_equal(100, @mmap.residency(5000, 100), 'locked range')
+    assert_equal(4096, @mmap.memory_stats[:locked], 'one page')
+    @mmap.munlock(offset: 5000, length: 100)
+    assert_equal(0, @mmap.memory_stats[:locked], 'unlocked')
+    @mmap.mlock(on_fault: true)
+    @mmap << ('x' * 100_000)
+    @mmap.to_str.sum
+    assert(@mmap.memory_stats[:locked] > 100_000, 'relocked after growth')
+    @mmap.munlock
+    assert_equal(0, @mmap.memory_stats[:locked], 'munlock')
+    assert_raises(IndexError) { @mmap.mlock(offset: -1) }
+  end
+
+  def test_prefetch
+    pf = @mmap.prefetch(4000, 20_000)
+    assert_same(pf, pf.wait, 'wait')
+    assert_equal(true, pf.done?, 'done?')
+    assert_equal(20_000, @mmap.residency(4000, 20_000), 'resident')
+    assert_equal(true, @mmap.prefetch(0, 0).done?, 'empty')
+    m0 = Mmap.new(@mmap_c, 'r', window: 4096)
+    m0.prefetch.wait
+    m0.munmap
+    assert_raises(IndexError) { @mmap.prefetch(@mmap.size + 1) }
+  end
+
+  def test_residency
+    @mmap.to_str.sum
+    assert_equal(@mmap.size, @mmap.residency, 'all resident')
+    assert_equal(100, @mmap.residency(5000, 100), 'range')
+    bits = @mmap.residency(bitmap: true)
+    assert_equal((@mmap.size + 4095) / 4096, bits.unpack1('b*').count('1'), 'bitmap')
+    assert_raises(IndexError) { @mmap.residency(-1) }
+    m0 = Mmap.new(nil, 1 << 20)
+    assert_equal(0, m0.residency, 'anonymous')
+    m0[0, 3] = 'abc'
+    assert_equal(4096, m0.residency(0, 8192), 'touched')
+    stats = m0.memory_stats
+    assert_equal(1 << 20, stats[:size], 'size')
+    assert(stats[:rss] >= 4096, 'rss')
+    assert(stats.key?(:swap) && stats.key?(:private_dirty), 'keys')
+    m0.munmap
+  end
+
+  def test_madvise_range
+    @mmap.madvise(Mmap::MADV_WILLNEED, offset: 0, length: 4096)
+    @mmap.madvise(Mmap::MADV_DONTNEED, offset: 5000)
+    @mmap.madvise(Mmap::MADV_COLD, offset: 8192, length: 4096) if defined?(Mmap::MADV_COLD)
+    if defined?(Mmap::MADV_POPULATE_READ)
+      @mmap.madvise(Mmap::MADV_POPULATE_READ, offset: 100, length: 10_000)
+    end
+    assert_equal(@str, @mmap.to_str, 'content kept')
+    assert_raises(IndexError) { @mmap.madvise(Mmap::MADV_NORMAL, offset: @mmap.size + 1) }
+    assert_raises(IndexError) { @mmap.madvise(Mmap::MADV_NORMAL, length: -1) }
+  end
+
+  def test_offset
+    off = 5003
+    m0 = Mmap.new(@mmap_c, 'r', offset: off, length: 100)
+    assert_equal(@str[off, 100], m0.to_str, 'record')
+    m0.madvise(Mmap::MADV_RANDOM)
+    m0.warmup(threads: 1)
+    assert_nil(m0.munmap, 'munmap')
+    m0 = Mmap.new(@mmap_c, 'r', offset: off)
+    assert_equal(@str[off..-1], m0.to_str, 'to end of file')
+    m0.munmap
+    m0 = Mmap.new(@mmap_c, 'r', offset: off, window: 4096)
+    assert_equal(@str[off..-1].bytes, m0.to_a, 'window')
+    m0.munmap
+    m0 = Mmap.new(@mmap_c, 'rw', offset: off, length: 3)
+    m0[0, 3] = 'abc'
+    m0.msync
+    m0.munmap
+    assert_equal('abc', File.binread(@mmap_c, 3, off), 'write')
+    assert_raises(ArgumentError) { Mmap.new(@mmap_c, 'r', offset: @str.size + 1) }
+  end
+
   def test_fileno
     @mmap = Mmap.new(File.new(@mmap_c, 'r+'), 'rw')
     test_aref
@@ -396,7 +1000,7 @@ class TestMmap < Minitest::Test
     return unless defined?(Mmap::MAP_ANONYMOUS)
 
     assert_raises(ArgumentError) { Mmap.new(nil, 'w') }
-    assert_kind_of(Mmap, m0 = Mmap.new(nil, 12), 'new w')
+    assert_kind_of(Mmap, m0 = Mmap.new(nil, 12, 'length' => 12), 'new w')
     assert_equal(false, m0.empty?, 'empty')
     assert_equal('a', m0[0] = 'a', 'set')
     assert_raises(TypeError) { m0 << 12 }
@@ -409,7 +1013,8 @@ class TestMmap < Minitest::Test
     assert_equal('x' * 12, m0.to_str, 'retrieve')
     assert_equal('ab', m0[1..2] = 'ab', 'range')
     assert_raises(TypeError) { m0[1..2] = 'abc' }
-    assert_raises(ArgumentError) { m0.lock }
+    assert_equal(m0, m0.lock, 'lock anonymous')
+    assert_equal(m0, m0.unlock, 'unlock anonymous')
     assert_raises(ArgumentError) { Mmap.lockall(0) }
     assert_nil(m0.munmap, 'munmap')
   end